@@ -2,8 +2,13 @@
 #define __common_h__
 
 #include <sys/time.h>
+#include <time.h>
+#include <errno.h>
 #include <assert.h>
+#include <stdint.h>
 
+// Wall-clock seconds. Microsecond resolution, and it steps when NTP or an
+// administrator sets the clock, so measure intervals with GetNanos instead.
 double GetTime() {
     struct timeval t;
     int rc = gettimeofday(&t, NULL);
@@ -11,12 +16,41 @@ double GetTime() {
     return (double)t.tv_sec + (double)t.tv_usec/1e6;
 }
 
-void Spin(int howlong) {
-    double t = GetTime();
-    while ((GetTime() - t) < (double)howlong)
-	; // do nothing in loop
+// Nanoseconds on CLOCK_MONOTONIC: integer, never steps backwards, and read
+// through the vDSO (no system call), so it is cheap enough to call per event.
+uint64_t GetNanos() {
+    struct timespec t;
+    int rc = clock_gettime(CLOCK_MONOTONIC, &t);
+    assert(rc == 0);
+    return (uint64_t)t.tv_sec * 1000000000ULL + (uint64_t)t.tv_nsec;
+}
+
+// Seconds on CLOCK_MONOTONIC (unaffected by wall-clock adjustments).
+double GetMonoTime() {
+    return (double)GetNanos() / 1e9;
 }
 
+// Busy-wait for howlong seconds, comparing integer monotonic readings.
+void Spin(double howlong) {
+    uint64_t end = GetNanos() + (uint64_t)(howlong * 1e9);
+    while (GetNanos() < end)
+	; // do nothing in loop
+}
 
+// Block until CLOCK_MONOTONIC reaches deadline (seconds, as GetMonoTime).
+// Sleeping to an absolute deadline keeps wake-up error from accumulating.
+void SleepUntil(double deadline) {
+    struct timespec t;
+    t.tv_sec = (time_t)deadline;
+    t.tv_nsec = (long)((deadline - (double)t.tv_sec) * 1e9);
+    if (t.tv_nsec >= 1000000000L) {
+        t.tv_sec++;
+        t.tv_nsec -= 1000000000L;
+    }
+    int rc;
+    while ((rc = clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &t, NULL)) == EINTR)
+	; // interrupted by a signal: sleep again toward the same deadline
+    assert(rc == 0);
+}
 
 #endif // __common_h__
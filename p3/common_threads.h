@@ -2,7 +2,14 @@
 #define __common_threads_h__
 
 #include <assert.h>
+#include <errno.h>
+#include <time.h>
+#include <limits.h>
+#include <stdint.h>
 #include <pthread.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
 
 void Pthread_create(pthread_t *t, const pthread_attr_t *attr,  
 		    void *(*start_routine)(void *), void *arg) {
@@ -30,4 +37,51 @@ void Pthread_mutex_init(pthread_mutex_t *mutex, pthread_mutexattr_t *attr) {
     assert(rc == 0);
 }
 
+void Pthread_barrier_init(pthread_barrier_t *barrier, unsigned count) {
+    int rc = pthread_barrier_init(barrier, NULL, count);
+    assert(rc == 0);
+}
+
+void Pthread_barrier_wait(pthread_barrier_t *barrier) {
+    int rc = pthread_barrier_wait(barrier);
+    assert(rc == 0 || rc == PTHREAD_BARRIER_SERIAL_THREAD);
+}
+
+// Sleep while *addr == val (returns at once if it already differs).
+void Futex_wait(void *addr, uint32_t val) {
+    long rc = syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, val, NULL, NULL, 0);
+    assert(rc == 0 || errno == EAGAIN || errno == EINTR);
+}
+
+// Futex_wait, but give up at deadline (CLOCK_MONOTONIC seconds, as
+// GetMonoTime).
+void Futex_wait_until(void *addr, uint32_t val, double deadline) {
+    struct timespec t;
+    t.tv_sec = (time_t)deadline;
+    t.tv_nsec = (long)((deadline - (double)t.tv_sec) * 1e9);
+    if (t.tv_nsec >= 1000000000L) {
+        t.tv_sec++;
+        t.tv_nsec -= 1000000000L;
+    }
+    // FUTEX_WAIT_BITSET takes an absolute CLOCK_MONOTONIC timeout
+    long rc = syscall(SYS_futex, addr, FUTEX_WAIT_BITSET_PRIVATE, val, &t, NULL,
+                      FUTEX_BITSET_MATCH_ANY);
+    assert(rc == 0 || errno == EAGAIN || errno == EINTR || errno == ETIMEDOUT);
+}
+
+// Wake every thread sleeping in Futex_wait on addr.
+void Futex_wake_all(void *addr) {
+    long rc = syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+    assert(rc >= 0);
+}
+
+// Futex_wake_all on a word its waiter may already have freed: once the
+// waiter sees the value stored before the wake, it can return and release
+// the memory. An unmapped address (EFAULT) is then fine, and anyone who
+// reuses the memory gets at most a spurious wakeup.
+void Futex_wake_stale(void *addr) {
+    long rc = syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+    assert(rc >= 0 || errno == EFAULT);
+}
+
 #endif // __common_threads_h__
@@ -0,0 +1,78 @@
+#ifndef __hist_h__
+#define __hist_h__
+
+// Log-linear (HDR-style) histogram of non-negative integer values.
+// Values below HIST_SUB are counted exactly; above that, every power-of-two
+// range is split into HIST_SUB equal buckets, so any recorded value is
+// reported within 1/HIST_SUB (about 3%) of its true value over the whole
+// range. Recording is a couple of shifts and an increment, with no locks:
+// each thread keeps its own histograms and they are merged at the end.
+
+#include <stdint.h>
+#include <string.h>
+
+#define HIST_SUB_BITS 5
+#define HIST_SUB      (1 << HIST_SUB_BITS)
+#define HIST_SHIFTS   36                          // values up to 2^41 - 1
+#define HIST_BUCKETS  ((HIST_SHIFTS + 1) * HIST_SUB)
+
+typedef struct {
+    uint64_t count;
+    uint64_t max;
+    uint64_t sum;                                 // exact, for HistMean
+    uint64_t buckets[HIST_BUCKETS];
+} hist_t;
+
+int HistIndex(uint64_t v) {
+    if (v < HIST_SUB) return (int)v;
+    int shift = (63 - __builtin_clzll(v)) - HIST_SUB_BITS;
+    if (shift >= HIST_SHIFTS) return HIST_BUCKETS - 1;
+    return (shift + 1) * HIST_SUB + (int)((v >> shift) - HIST_SUB);
+}
+
+// Midpoint of the values that land in bucket i.
+uint64_t HistValue(int i) {
+    if (i < HIST_SUB) return (uint64_t)i;
+    int shift = i / HIST_SUB - 1;
+    uint64_t low = (uint64_t)(HIST_SUB + i % HIST_SUB) << shift;
+    return low + ((1ULL << shift) >> 1);
+}
+
+void HistRecord(hist_t *h, uint64_t v) {
+    h->buckets[HistIndex(v)]++;
+    h->count++;
+    h->sum += v;
+    if (v > h->max) h->max = v;
+}
+
+void HistMerge(hist_t *into, const hist_t *from) {
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        into->buckets[i] += from->buckets[i];
+    }
+    into->count += from->count;
+    into->sum += from->sum;
+    if (from->max > into->max) into->max = from->max;
+}
+
+double HistMean(const hist_t *h) {
+    return h->count ? (double)h->sum / (double)h->count : 0.0;
+}
+
+// Value at quantile q (0..1); the exact maximum for q >= 1.
+uint64_t HistQuantile(const hist_t *h, double q) {
+    if (h->count == 0) return 0;
+    if (q >= 1.0) return h->max;
+    uint64_t rank = (uint64_t)(q * (double)h->count);
+    if (rank >= h->count) rank = h->count - 1;
+    uint64_t seen = 0;
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        seen += h->buckets[i];
+        if (seen > rank) {
+            uint64_t v = HistValue(i);
+            return v < h->max ? v : h->max;
+        }
+    }
+    return h->max;
+}
+
+#endif // __hist_h__
@@ -1,6 +1,6 @@
 // tc.c  (Traffic Control System)
 // Implements a multi-threaded four-way intersection using:
-//   - per-direction head-of-line semaphores (fairness for each stop sign)
+//   - per-direction head-of-line queues (FIFO at each stop sign)
 //   - same-direction "flow" similar to readers in readers–writers
 //   - quadrant-level mutex locks to prevent collisions
 
@@ -9,17 +9,109 @@
 //   2) Crosses the intersection (CrossIntersection)
 //   3) Exits the intersection (ExitIntersection)
 
+#define _GNU_SOURCE   // CPU affinity (see "CPU placement")
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
+#include <getopt.h>
 #include <pthread.h>
-#include <semaphore.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <limits.h>
+#include <ctype.h>
+#include <math.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <sched.h>
 
 #include "common.h"
 #include "common_threads.h"
+#include "hist.h"
 
 #define NUM_CARS 8
 
+// Head-of-line queues ---------------------------------------------------------------
+// One per approach; the car at its head holds the approach's head-of-line
+// token. An MCS queue: a waiting car links its own node (in its car_t) behind
+// the last one, polls that node briefly and then sleeps on its futex word, and
+// the car giving up the token hands it straight to its successor. So cars are
+// served strictly in the order they queued, a waiter touches no cache line but
+// its own, and taking or releasing an uncontended token is one atomic
+// exchange or CAS with no system call.
+
+#define HOL_SPIN 100              // polls of our own node before sleeping
+
+enum {HOL_WAITING, HOL_PARKED, HOL_GRANTED};
+
+typedef struct hol_node {
+    _Atomic(struct hol_node *) next;
+    _Atomic uint32_t state;       // HOL_*; the futex word while parked
+} hol_node_t;
+
+// Cache-line aligned, so cars queueing on different approaches don't share one.
+typedef struct {
+    _Alignas(64) _Atomic(hol_node_t *) tail;  // last car queued, NULL when free
+    _Atomic int queued;           // cars waiting behind the holder
+} hol_queue_t;
+
+// Queue me; return 1 if that made it the holder, else hol_wait for the token.
+int hol_enqueue(hol_queue_t *q, hol_node_t *me) {
+    atomic_store_explicit(&me->next, NULL, memory_order_relaxed);
+    atomic_store_explicit(&me->state, HOL_WAITING, memory_order_relaxed);
+    hol_node_t *prev = atomic_exchange_explicit(&q->tail, me, memory_order_acq_rel);
+    if (prev == NULL) return 1;
+    atomic_fetch_add_explicit(&q->queued, 1, memory_order_relaxed);
+    atomic_store_explicit(&prev->next, me, memory_order_release);
+    return 0;
+}
+
+void hol_wait(hol_queue_t *q, hol_node_t *me) {
+    int spins = 0;
+    while (atomic_load_explicit(&me->state, memory_order_acquire) != HOL_GRANTED) {
+        if (spins < HOL_SPIN) {
+            spins++;
+            continue;
+        }
+        uint32_t st = HOL_WAITING;
+        if (atomic_compare_exchange_strong(&me->state, &st, HOL_PARKED) || st == HOL_PARKED) {
+            Futex_wait(&me->state, HOL_PARKED);
+        }
+    }
+    atomic_fetch_sub_explicit(&q->queued, 1, memory_order_relaxed);
+}
+
+void hol_acquire(hol_queue_t *q, hol_node_t *me) {
+    if (!hol_enqueue(q, me)) hol_wait(q, me);
+}
+
+// Pass the token from me (the holder) to the next car, or free it.
+void hol_release(hol_queue_t *q, hol_node_t *me) {
+    hol_node_t *succ = atomic_load_explicit(&me->next, memory_order_acquire);
+    if (succ == NULL) {
+        hol_node_t *expect = me;
+        if (atomic_compare_exchange_strong_explicit(&q->tail, &expect, NULL,
+                                                    memory_order_acq_rel,
+                                                    memory_order_relaxed)) return;
+        // a car has swapped itself in as tail but not linked itself yet
+        while ((succ = atomic_load_explicit(&me->next, memory_order_acquire)) == NULL) {
+            sched_yield();
+        }
+    }
+    if (atomic_exchange_explicit(&succ->state, HOL_GRANTED, memory_order_release) == HOL_PARKED) {
+        // only succ sleeps on its own word, and it may be gone already
+        Futex_wake_stale(&succ->state);
+    }
+}
+
+// Cars holding or waiting for the token, in O(1).
+int hol_depth(hol_queue_t *q) {
+    return atomic_load_explicit(&q->queued, memory_order_relaxed) +
+           (atomic_load_explicit(&q->tail, memory_order_relaxed) != NULL);
+}
+
 // Directions: original and target
 typedef struct _directions {
     char dir_original; // starting direction (N, S, W, E)
@@ -27,11 +119,37 @@ typedef struct _directions {
 } directions;
 
 // Car information
-typedef struct {
+typedef struct _car {
     int cid;             // car id (1..NUM_CARS)
     double arrival_time; // when it arrives at intersection (seconds)
     directions dirs;     // original + target directions
     int index;           // global arrival order (0..NUM_CARS-1)
+
+    struct _car *next;   // link while on a wait list
+    int bypassed;        // times overtaken at the conflict gate
+    int admitted;        // set by gate_admit, possibly on the car's behalf
+
+    // grid routing (see "Road grid"; a single intersection is node 0)
+    int node;            // intersection the car is at or heading to
+    int dest;            // intersection where it makes its final turn
+    int final_turn;      // turn_t taken at dest
+
+    // event-engine bookkeeping (unused by the pthread version)
+    int state;           // car_state_t
+    int q[4];            // quadrants needed, in lock order
+    int nq;              // number of entries in q
+    int quads_held;      // prefix of q[] currently held
+
+    hol_node_t hol;      // place in a head-of-line queue (pthread version)
+    double cross_drift;  // actual minus nominal crossing time (seconds)
+
+    // phase boundaries (seconds since start), for --latency
+    double t_arrive;     // reached the stop sign
+    double t_stop;       // mandatory stop done
+    double t_hol;        // head of line for its direction
+    double t_granted;    // admitted by the direction/conflict gate
+    double t_quads;      // holds its quadrants, starts crossing
+    double t_exit;       // left the intersection
 } car_t;
 
 // Direction indices for arrays
@@ -39,32 +157,122 @@ enum {DIR_N = 0, DIR_E = 1, DIR_S = 2, DIR_W = 3};
 
 // Hard-coded cars (input example)
 car_t cars[NUM_CARS] = {
-    {1, 1.1, {'^', '^'}, 0},
-    {2, 2.2, {'^', '^'}, 1},
-    {3, 3.3, {'^', '<'}, 2},
-    {4, 4.4, {'v', 'v'}, 3},
-    {5, 5.5, {'v', '>'}, 4},
-    {6, 6.6, {'^', '^'}, 5},
-    {7, 7.7, {'>', '^'}, 6},
-    {8, 8.8, {'<', '^'}, 7}
+    {.cid = 1, .arrival_time = 1.1, .dirs = {'^', '^'}, .index = 0},
+    {.cid = 2, .arrival_time = 2.2, .dirs = {'^', '^'}, .index = 1},
+    {.cid = 3, .arrival_time = 3.3, .dirs = {'^', '<'}, .index = 2},
+    {.cid = 4, .arrival_time = 4.4, .dirs = {'v', 'v'}, .index = 3},
+    {.cid = 5, .arrival_time = 5.5, .dirs = {'v', '>'}, .index = 4},
+    {.cid = 6, .arrival_time = 6.6, .dirs = {'^', '^'}, .index = 5},
+    {.cid = 7, .arrival_time = 7.7, .dirs = {'>', '^'}, .index = 6},
+    {.cid = 8, .arrival_time = 8.8, .dirs = {'<', '^'}, .index = 7}
 };
 
-// Quadrant locks
-pthread_mutex_t quad[4];    // quad 0 = NW, 1 = NE, 2 = SE, 3 = SW (counter-clockwise ordering)
 pthread_mutex_t print_lock; // Mutex to serialize printing (so log lines don't interleave)
 
-// Direction flow control
-pthread_mutex_t turn_lock;   // protects current_direction & flow_count
-pthread_cond_t  turn_cv;    //  used to wake waiting directions when flow ends
+// The quadrant locks, direction flow control and head-of-line queues of
+// each intersection live in intersection_t (see "Intersection state").
+
+// Simulation timing: GetNanos() when the run started (atomic only because
+// the --metrics publisher may be running before an engine sets it)
+_Atomic uint64_t start_ns;
+
+// Simulated seconds per real second (--speed). The real-time engines sleep
+// and spin for 1/time_scale of every simulated delay, and now() scales back,
+// so logs and latencies are still in simulated seconds.
+double time_scale = 1.0;
+
+// How CrossIntersection waits out the crossing time
+typedef enum {CROSS_SPIN, CROSS_SLEEP} cross_mode_t;
+cross_mode_t cross_mode = CROSS_SPIN;
 
-int current_direction = -1;  // -1 means no direction currently owns intersection
-int flow_count[4] = {0};     // number of cars from each direction crossing
+// When a car gives up its direction's head-of-line token:
+//   FLOW_SERIAL:    at exit, so same-direction cars cross one after another
+//   FLOW_PIPELINED: as soon as it holds its quadrants, so the next car from
+//                   the same direction moves up and joins the flow
+typedef enum {FLOW_SERIAL, FLOW_PIPELINED} flow_mode_t;
 
-// Per-direction head-of-line semaphores
-sem_t hol_sem[4];
+// Who is woken when the intersection changes hands:
+//   WAKE_BROADCAST: every waiting car, and the first to get turn_lock wins
+//   WAKE_TARGETED:  the exiting car asks the scheduler (sched_policy) who
+//                   goes next, hands over and signals only that dir_cv
+typedef enum {WAKE_BROADCAST, WAKE_TARGETED} wakeup_mode_t;
 
-// Simulation timing
-double start_time;
+// How a car takes its quadrants (see "Atomic quadrant reservation")
+typedef enum {QUADS_MUTEX, QUADS_MASK} quad_mode_t;
+
+// Who may be in the intersection together (see "Conflict-matrix admission")
+typedef enum {ADMIT_DIRECTION, ADMIT_CONFLICT} admission_t;
+
+// Who gets the intersection next (see "Scheduling policies")
+typedef enum {POLICY_RACE, POLICY_RR, POLICY_LQF, POLICY_OLDEST, POLICY_MAXWEIGHT} sched_policy_t;
+const char *sched_names[] = {"race", "rr", "lqf", "oldest", "maxweight"};
+
+// Layout of the road network (see "Road grid")
+typedef struct {
+    int rows, cols;
+    double link_time;       // seconds between neighbouring intersections
+} grid_t;
+
+// Traffic lights instead of stop signs (see "Signal control")
+typedef enum {SIGNAL_OFF, SIGNAL_FIXED, SIGNAL_ACTUATED, SIGNAL_PRESSURE} signal_mode_t;
+const char *signal_names[] = {"off", "fixed", "actuated", "pressure"};
+
+#define MAX_PHASES 8
+
+// Movements given green by a phase: approaches a (bit d for direction index
+// d) times turns t (bit 0 left, 1 straight, 2 right), as movement id bits.
+#define PHASE_GREEN(a, t) (((a) & 1 ? (t) : 0) | ((a) & 2 ? (t) << 3 : 0) | \
+                           ((a) & 4 ? (t) << 6 : 0) | ((a) & 8 ? (t) << 9 : 0))
+
+typedef struct {
+    int green;              // bit m set if movement m has green
+    double time;            // seconds; the longest it may run when actuated
+} phase_t;
+
+// Run configuration -------------------------------------------------------------
+// Everything a run's outcome depends on besides its cars. Engines read it
+// through cfg, which points at config (filled in from the command line)
+// unless the thread is running one point of a sweep (see "Parameter sweeps").
+
+typedef struct {
+    double stop_time;            // mandatory stop at the sign (seconds)
+    double cross_time[3];        // crossing time by turn_t (seconds)
+    flow_mode_t flow_mode;
+    wakeup_mode_t wakeup_mode;
+    quad_mode_t quad_mode;
+    admission_t admission;
+    int starve_limit;            // see "Conflict-matrix admission"
+    sched_policy_t sched_policy;
+    int flow_cap;                // 0 = unlimited
+    grid_t grid;
+    int grid_on;                 // cars are routed (--grid given)
+    signal_mode_t signal;
+    int nphases;                 // signal plan (--phases)
+    phase_t phases[MAX_PHASES];
+} run_config_t;
+
+run_config_t config = {
+    .stop_time = 2,
+    .cross_time = {5, 4, 3},     // left, straight, right
+    .flow_mode = FLOW_SERIAL,
+    .wakeup_mode = WAKE_BROADCAST,
+    .quad_mode = QUADS_MUTEX,
+    .admission = ADMIT_DIRECTION,
+    .starve_limit = 4,
+    .sched_policy = POLICY_RACE,
+    .flow_cap = 0,
+    .grid = {1, 1, 10.0},
+    .grid_on = 0,
+    .signal = SIGNAL_OFF,
+    .nphases = 4,
+    .phases = {
+        {PHASE_GREEN(0x5, 0x6), 30},   // N/S straight and right
+        {PHASE_GREEN(0x5, 0x1), 10},   // N/S left
+        {PHASE_GREEN(0xa, 0x6), 30},   // E/W straight and right
+        {PHASE_GREEN(0xa, 0x1), 10},   // E/W left
+    },
+};
+_Thread_local const run_config_t *cfg = &config;
 
 // Helper functions ------------------------------------------------------------
 
@@ -79,273 +287,5659 @@ int dir_index(char d) {
     }
 }
 
-// Return time elapsed since program start.
+// Return simulated time elapsed since program start (seconds, nanosecond
+// resolution at --speed 1).
 double now() {
-    return GetTime() - start_time;
+    return (double)(GetNanos() - start_ns) / 1e9 * time_scale;
+}
+
+// CLOCK_MONOTONIC seconds (as GetMonoTime) at which now() reaches t.
+double mono_at(double t) {
+    return (double)start_ns / 1e9 + t / time_scale;
+}
+
+// Absolute CLOCK_MONOTONIC deadline for simulation time t (seconds).
+struct timespec deadline_at(double t) {
+    double abs_t = mono_at(t);
+    struct timespec ts;
+    ts.tv_sec = (time_t)abs_t;
+    ts.tv_nsec = (long)((abs_t - (double)ts.tv_sec) * 1e9);
+    if (ts.tv_nsec >= 1000000000L) {
+        ts.tv_sec++;
+        ts.tv_nsec -= 1000000000L;
+    }
+    return ts;
+}
+
+// Sleep for secs of simulated time.
+void sim_sleep(double secs) {
+    if (secs > 0) SleepUntil(GetMonoTime() + secs / time_scale);
+}
+
+// Contention counters ------------------------------------------------------------
+// Built with -DTC_LOCK_STATS, every synchronization primitive counts its
+// acquisitions, how many of them had to block, and the total and longest
+// time spent blocked; turn_cv and dir_cv count wakeups and the useless ones
+// (the waiter re-checked and went back to sleep). A table is printed at exit.
+// Without the flag the STAT_* macros expand to the plain calls and nothing is
+// counted.
+
+#ifdef TC_LOCK_STATS
+
+typedef struct {
+    const char *name;
+    _Atomic uint64_t acquired;
+    _Atomic uint64_t contended;
+    _Atomic uint64_t blocked_ns;
+    _Atomic uint64_t max_blocked_ns;
+} lock_stat_t;
+
+lock_stat_t quad_stats[4] = {{.name = "quad[0]"}, {.name = "quad[1]"},
+                             {.name = "quad[2]"}, {.name = "quad[3]"}};
+lock_stat_t quad_mask_stats = {.name = "quad_mask"};
+lock_stat_t turn_lock_stats = {.name = "turn_lock"};
+lock_stat_t hol_stats[4] = {{.name = "hol[N]"}, {.name = "hol[E]"},
+                            {.name = "hol[S]"}, {.name = "hol[W]"}};
+_Atomic int hol_peak[4];          // deepest each head-of-line queue got
+lock_stat_t print_lock_stats = {.name = "print_lock"};
+
+_Atomic uint64_t turn_cv_wakeups;
+_Atomic uint64_t turn_cv_useless;
+
+void lock_stat_add(lock_stat_t *st, uint64_t blocked_since) {
+    atomic_fetch_add_explicit(&st->acquired, 1, memory_order_relaxed);
+    if (blocked_since == 0) return;
+
+    uint64_t ns = GetNanos() - blocked_since;
+    atomic_fetch_add_explicit(&st->contended, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&st->blocked_ns, ns, memory_order_relaxed);
+    uint64_t max = atomic_load_explicit(&st->max_blocked_ns, memory_order_relaxed);
+    while (ns > max && !atomic_compare_exchange_weak_explicit(&st->max_blocked_ns, &max, ns,
+                                                              memory_order_relaxed,
+                                                              memory_order_relaxed))
+        ;
+}
+
+void stat_mutex_lock(pthread_mutex_t *m, lock_stat_t *st) {
+    if (pthread_mutex_trylock(m) == 0) {
+        lock_stat_add(st, 0);
+        return;
+    }
+    uint64_t t0 = GetNanos();
+    Pthread_mutex_lock(m);
+    lock_stat_add(st, t0);
+}
+
+void stat_hol_acquire(hol_queue_t *q, hol_node_t *me, int d) {
+    if (hol_enqueue(q, me)) {
+        lock_stat_add(&hol_stats[d], 0);
+        return;
+    }
+    uint64_t t0 = GetNanos();
+    int depth = hol_depth(q), peak = atomic_load(&hol_peak[d]);
+    while (depth > peak && !atomic_compare_exchange_weak(&hol_peak[d], &peak, depth))
+        ;
+    hol_wait(q, me);
+    lock_stat_add(&hol_stats[d], t0);
+}
+
+// A waiter returned from pthread_cond_wait; it will sleep again if !useful.
+void stat_cv_wakeup(int useful) {
+    atomic_fetch_add_explicit(&turn_cv_wakeups, 1, memory_order_relaxed);
+    if (!useful) atomic_fetch_add_explicit(&turn_cv_useless, 1, memory_order_relaxed);
+}
+
+void print_lock_stat(FILE *f, const lock_stat_t *st) {
+    uint64_t acq = atomic_load(&st->acquired);
+    uint64_t con = atomic_load(&st->contended);
+    fprintf(f, "  %-11s %10llu %10llu %6.1f%% %12.3f %10.3f\n", st->name,
+            (unsigned long long)acq, (unsigned long long)con,
+            acq ? 100.0 * con / acq : 0.0,
+            atomic_load(&st->blocked_ns) / 1e6, atomic_load(&st->max_blocked_ns) / 1e6);
 }
 
-// Thread-safe printing of events.
-void log_event(const char *event, car_t *c) {
-    Pthread_mutex_lock(&print_lock);
-    printf("Time %.1f: Car %d (%c %c) %s\n",
-           now(),
-           c->cid,
-           c->dirs.dir_original,
-           c->dirs.dir_target,
-           event);
-    fflush(stdout);
-    Pthread_mutex_unlock(&print_lock);
+void lock_stats_report(FILE *f) {
+    fprintf(f, "Lock contention:\n");
+    fprintf(f, "  %-11s %10s %10s %7s %12s %10s\n",
+            "primitive", "acquired", "contended", "rate", "blocked ms", "max ms");
+    for (int i = 0; i < 4; i++) print_lock_stat(f, &quad_stats[i]);
+    print_lock_stat(f, &quad_mask_stats);
+    print_lock_stat(f, &turn_lock_stats);
+    for (int i = 0; i < 4; i++) print_lock_stat(f, &hol_stats[i]);
+    print_lock_stat(f, &print_lock_stats);
+    fprintf(f, "  hol queue peak depth N %d, E %d, S %d, W %d\n",
+            atomic_load(&hol_peak[0]), atomic_load(&hol_peak[1]),
+            atomic_load(&hol_peak[2]), atomic_load(&hol_peak[3]));
+    fprintf(f, "  turn_cv/dir_cv wakeups %llu, useless %llu\n",
+            (unsigned long long)atomic_load(&turn_cv_wakeups),
+            (unsigned long long)atomic_load(&turn_cv_useless));
 }
 
-// Turn Interpretation (Left / Straight / Right) ---------------------------------
+#define STAT_MUTEX_LOCK(m, st)  stat_mutex_lock(m, st)
+#define STAT_HOL_ACQUIRE(q, me, d) stat_hol_acquire(q, me, d)
+#define STAT_CV_WAKEUP(useful)  stat_cv_wakeup(useful)
+#define STAT_MASK_BLOCKED(t0)   do { if ((t0) == 0) (t0) = GetNanos(); } while (0)
+#define STAT_MASK_ACQUIRED(t0)  lock_stat_add(&quad_mask_stats, t0)
+#define LOCK_STATS_REPORT(f)    lock_stats_report(f)
+
+#else
+
+#define STAT_MUTEX_LOCK(m, st)  Pthread_mutex_lock(m)
+#define STAT_HOL_ACQUIRE(q, me, d) hol_acquire(q, me)
+#define STAT_CV_WAKEUP(useful)  ((void)0)
+#define STAT_MASK_BLOCKED(t0)   ((void)0)
+#define STAT_MASK_ACQUIRED(t0)  ((void)0)
+#define LOCK_STATS_REPORT(f)    ((void)0)
+
+#endif // TC_LOCK_STATS
+
+// Movement table (Left / Straight / Right) -------------------------------------
+// Everything about a movement is fixed by (origin, target), so it is computed
+// once, at compile time, into move_table[dir_index(orig)][dir_index(target)]:
+// turn type, quadrant bitmask, and the quadrants in lock order. Crossing times
+// are not part of a movement; they are per-run defaults in cfg->cross_time.
+//
+// Rules encoded by the macros below (d = direction index, N=0 E=1 S=2 W=3):
+//   - target == origin is straight, origin+1 is a right turn, origin+3 is a
+//     left turn (a U-turn, origin+2, is treated as straight)
+//   - a car enters through quadrant (d+1)%4 and sweeps counter-clockwise
+//     through 1 (right), 2 (straight) or 3 (left) quadrants
 
 // Turn types
 typedef enum {LEFT_T, STRAIGHT_T, RIGHT_T} turn_t;
 
-// Determine type of turn based on original and target direction.
-turn_t get_turn(directions *d) {
-    char o = d->dir_original;
-    char t = d->dir_target;
+typedef struct {
+    turn_t turn;
+    int id;          // movement id: origin * 3 + turn (0..NUM_MOVES-1)
+    int mask;        // bit i set if quadrant i is used
+    int nq;          // number of quadrants used
+    int quads[3];    // quadrants used, ascending (the lock order)
+} movement_t;
+
+// Movements are numbered dir_index(orig) * 3 + turn.
+#define NUM_MOVES 12
 
-    if (o == t) return STRAIGHT_T;
+#define MV_TURN(o, t)  ((t) == (o) ? STRAIGHT_T :           \
+                        (t) == ((o) + 1) % 4 ? RIGHT_T :    \
+                        (t) == ((o) + 3) % 4 ? LEFT_T : STRAIGHT_T)
+#define MV_LEN(turn)   ((turn) == RIGHT_T ? 1 : (turn) == STRAIGHT_T ? 2 : 3)
+#define MV_MASK(o, n)  ((1 << (((o) + 1) % 4)) |                    \
+                        ((n) >= 2 ? 1 << (((o) + 2) % 4) : 0) |    \
+                        ((n) >= 3 ? 1 << (((o) + 3) % 4) : 0))
 
-    if (o == '^' && t == '>') return RIGHT_T;
-    if (o == '^' && t == '<') return LEFT_T;
+// Index of the lowest set bit of a 4-bit mask, and of the k-th lowest.
+#define LOW_BIT(m)     ((m) & 1 ? 0 : (m) & 2 ? 1 : (m) & 4 ? 2 : 3)
+#define DROP_LOW(m)    ((m) & ((m) - 1))
+#define NTH_BIT(m, k)  ((k) == 0 ? LOW_BIT(m) :                 \
+                        (k) == 1 ? LOW_BIT(DROP_LOW(m)) :       \
+                                   LOW_BIT(DROP_LOW(DROP_LOW(m))))
 
-    if (o == 'v' && t == '<') return RIGHT_T;
-    if (o == 'v' && t == '>') return LEFT_T;
+#define MV_ENTRY(o, t, turn, mask) \
+    {turn, (o) * 3 + (turn), mask, MV_LEN(turn), \
+     {NTH_BIT(mask, 0), NTH_BIT(mask, 1), NTH_BIT(mask, 2)}}
+#define MV(o, t)       MV_ENTRY(o, t, MV_TURN(o, t), MV_MASK(o, MV_LEN(MV_TURN(o, t))))
+#define MV_ROW(o)      {MV(o, 0), MV(o, 1), MV(o, 2), MV(o, 3)}
 
-    if (o == '>' && t == 'v') return RIGHT_T;
-    if (o == '>' && t == '^') return LEFT_T;
+const movement_t move_table[4][4] = {MV_ROW(0), MV_ROW(1), MV_ROW(2), MV_ROW(3)};
 
-    if (o == '<' && t == '^') return RIGHT_T;
-    if (o == '<' && t == 'v') return LEFT_T;
+// movement_conflict[a][b] != 0 when movements a and b share a quadrant,
+// derived from the same masks as move_table.
+#define ID_MASK(m)     MV_MASK((m) / 3, MV_LEN((m) % 3))
+#define CONFLICT(a, b) ((ID_MASK(a) & ID_MASK(b)) != 0)
+#define CONFLICT_ROW(a) {CONFLICT(a, 0), CONFLICT(a, 1), CONFLICT(a, 2),  \
+                         CONFLICT(a, 3), CONFLICT(a, 4), CONFLICT(a, 5),  \
+                         CONFLICT(a, 6), CONFLICT(a, 7), CONFLICT(a, 8),  \
+                         CONFLICT(a, 9), CONFLICT(a, 10), CONFLICT(a, 11)}
 
-    return STRAIGHT_T;
+const int movement_conflict[NUM_MOVES][NUM_MOVES] = {
+    CONFLICT_ROW(0), CONFLICT_ROW(1), CONFLICT_ROW(2),  CONFLICT_ROW(3),
+    CONFLICT_ROW(4), CONFLICT_ROW(5), CONFLICT_ROW(6),  CONFLICT_ROW(7),
+    CONFLICT_ROW(8), CONFLICT_ROW(9), CONFLICT_ROW(10), CONFLICT_ROW(11)
+};
+
+// ASCII direction for each internal enum index.
+const char dir_chars[4] = {'^', '>', 'v', '<'};
+
+// Table entry for a pair of directions (both must be valid direction chars).
+const movement_t *get_move(directions *d) {
+    int o = dir_index(d->dir_original);
+    int t = dir_index(d->dir_target);
+    assert(o >= 0 && t >= 0);
+    return &move_table[o][t];
+}
+
+// Determine type of turn based on original and target direction.
+turn_t get_turn(directions *d) {
+    return get_move(d)->turn;
+}
+
+int movement_id(directions *d) {
+    return get_move(d)->id;
 }
 
 // Quadrant Mapping ------------------------------------------------------------
 
-// Fill q[] with quadrants this car needs, return count
+// Fill q[] with quadrants this car needs (already in lock order), return count
 int get_quads(car_t *c, int q[]) {
-    char o = c->dirs.dir_original;
-    turn_t t = get_turn(&c->dirs);
-    int n = 0;
+    const movement_t *m = get_move(&c->dirs);
+    for (int i = 0; i < m->nq; i++) {
+        q[i] = m->quads[i];
+    }
+    return m->nq;
+}
+
+// Safety verifier -----------------------------------------------------------------
+// Checks, on every run, the properties the admission modes rely on quadrant
+// locking for; a violation names the cars involved and aborts. It costs a few
+// bit operations and atomics on the intersection's own cache lines per
+// quadrant, with no global lock, so it stays on for million-car runs (build
+// with -DTC_NO_VERIFY to compile it out).
+//   occupancy  each intersection keeps a shadow bitmap of the quadrants of
+//              the cars crossing it; a car starting to cross must find its
+//              get_quads mask clear there, whatever admission, flow or quad
+//              mode let it in, and (mutex mode) must hold every one of them
+//   lock order a car only ever locks a quadrant above every one it holds
+//   wait-for   a car blocking on a quadrant marks the quadrants it holds as
+//              waiting for that one, then follows the chain: the quadrant
+//              the holder of its quadrant waits for, the one the holder of
+//              that waits for, ... (at most four long); reaching a quadrant
+//              it holds itself is a cycle. The chain lives in the
+//              intersection's verify_t, never in other cars, which may be
+//              gone by the time it is read. It is read without locks, so a
+//              cycle must be seen twice before it is reported; a real one
+//              does not go away.
+// The event engines check the same against sim_node_t at the same points.
+
+typedef struct {
+    _Atomic uint32_t occupied;    // quadrants of cars crossing now
+    _Atomic(car_t *) owner[4];    // holder of quad[i] in mutex mode
+    _Atomic int waits_for[4];     // 1 + the quadrant the holder of quad[i] is
+                                  // blocked on, 0 while it isn't
+} verify_t;
+
+_Thread_local uint32_t verify_held;  // quadrants the calling thread has locked
+_Thread_local uint32_t verify_marked; // of those, the ones marked in waits_for
 
-    // quad 0 = NW, 1 = NE, 2 = SE, 3 = SW
-    if (o == '^') {            // from North
-        if (t == RIGHT_T) {    // N -> E
-            q[n++] = 1;
-        } else if (t == STRAIGHT_T) { // N -> S
-            q[n++] = 1;
-            q[n++] = 2;
-        } else {               // N -> W (left)
-            q[n++] = 1;
-            q[n++] = 2;
-            q[n++] = 3;
-        }
-    } else if (o == '>') {     // from East
-        if (t == RIGHT_T) {    // E -> S
-            q[n++] = 2;
-        } else if (t == STRAIGHT_T) { // E -> W
-            q[n++] = 2;
-            q[n++] = 3;
-        } else {               // E -> N (left)
-            q[n++] = 2;
-            q[n++] = 3;
-            q[n++] = 0;
-        }
-    } else if (o == 'v') {     // from South
-        if (t == RIGHT_T) {    // S -> W
-            q[n++] = 3;
-        } else if (t == STRAIGHT_T) { // S -> N
-            q[n++] = 3;
-            q[n++] = 0;
-        } else {               // S -> E (left)
-            q[n++] = 3;
-            q[n++] = 0;
-            q[n++] = 1;
-        }
-    } else if (o == '<') {     // from West
-        if (t == RIGHT_T) {    // W -> N
-            q[n++] = 0;
-        } else if (t == STRAIGHT_T) { // W -> E
-            q[n++] = 0;
-            q[n++] = 1;
-        } else {               // W -> S (left)
-            q[n++] = 0;
-            q[n++] = 1;
-            q[n++] = 2;
+void verify_fail(const char *what, const car_t *a, const car_t *b, uint32_t m) {
+    fprintf(stderr, "safety violation: %s: car %d", what, a->cid);
+    if (b != NULL) fprintf(stderr, " and car %d", b->cid);
+    fprintf(stderr, ", quadrants 0x%x, intersection %d\n", m, a->node);
+    abort();
+}
+
+// Follow the wait-for chain from quadrant q; return the quadrant held by the
+// calling thread that it comes back to, or -1 if it ends.
+int verify_chain(verify_t *v, int q) {
+    for (int hops = 0; hops < 4; hops++) {
+        int w = atomic_load_explicit(&v->waits_for[q], memory_order_acquire) - 1;
+        if (w < 0) return -1;
+        if (verify_held & 1u << w) return w;
+        q = w;
+    }
+    return -1;
+}
+
+// c is about to lock quadrant q.
+void verify_lock(verify_t *v, car_t *c, int q) {
+    if (verify_held & ~((1u << q) - 1)) verify_fail("quadrant locked out of order", c, NULL,
+                                                    verify_held | 1u << q);
+    // holding nothing, c can't close a cycle
+    if (verify_held == 0 || atomic_load_explicit(&v->owner[q], memory_order_relaxed) == NULL) {
+        return;
+    }
+    for (int i = 0; i < 4; i++) {
+        if (verify_held & 1u << i) {
+            atomic_store_explicit(&v->waits_for[i], q + 1, memory_order_release);
+        }
+    }
+    verify_marked = verify_held;
+    int w = verify_chain(v, q);
+    if (w >= 0) {
+        sched_yield();
+        if (verify_chain(v, q) == w) {
+            // the cars of a real cycle are stuck, so the owner is still there
+            verify_fail("wait-for cycle", c, atomic_load(&v->owner[q]), 1u << q | 1u << w);
         }
     }
+}
 
-    return n;
+// c now holds quadrant q.
+void verify_locked(verify_t *v, car_t *c, int q) {
+    for (int i = 0; verify_marked != 0 && i < 4; i++) {
+        if (verify_marked & 1u << i) atomic_store_explicit(&v->waits_for[i], 0,
+                                                           memory_order_relaxed);
+    }
+    verify_marked = 0;
+    atomic_store_explicit(&v->owner[q], c, memory_order_release);
+    verify_held |= 1u << q;
 }
 
-// Lock quadrants in sorted order to avoid circular wait.
-void lock_quads(int q[], int n) {
-    // sort q in ascending order, then lock
-    for (int i = 0; i < n; i++) {
-        for (int j = i + 1; j < n; j++) {
-            if (q[j] < q[i]) {
-                int tmp = q[i];
-                q[i] = q[j];
-                q[j] = tmp;
-            }
+// c is about to unlock quadrant q.
+void verify_unlock(verify_t *v, car_t *c, int q) {
+    (void)c;
+    atomic_store_explicit(&v->owner[q], NULL, memory_order_relaxed);
+    verify_held &= ~(1u << q);
+}
+
+// c starts crossing quadrants m; mutex says whether it should hold them.
+void verify_enter(verify_t *v, car_t *c, uint32_t m, int mutex) {
+    if (mutex && verify_held != m) verify_fail("crossing without its quadrants", c, NULL,
+                                               verify_held ^ m);
+    uint32_t was = atomic_fetch_or_explicit(&v->occupied, m, memory_order_acq_rel);
+    if (was & m) {
+        car_t *o = NULL;
+        for (int i = 0; i < 4 && o == NULL; i++) {
+            car_t *w = atomic_load(&v->owner[i]);
+            if ((was & m & (1u << i)) && w != c) o = w;
         }
+        verify_fail("crossing cars overlap", c, o, was & m);
     }
-    for (int i = 0; i < n; i++) {
-        Pthread_mutex_lock(&quad[q[i]]);
+}
+
+// c is done crossing quadrants m.
+void verify_leave(verify_t *v, car_t *c, uint32_t m) {
+    uint32_t was = atomic_fetch_and_explicit(&v->occupied, ~m, memory_order_acq_rel);
+    if ((was & m) != m) verify_fail("quadrants left that were not occupied", c, NULL, m & ~was);
+}
+
+#ifndef TC_NO_VERIFY
+#define VERIFY(call)  call
+#else
+#define VERIFY(call)  do { if (0) { call; } } while (0)  // still type-checked
+#endif
+
+// Road grid ----------------------------------------------------------------------
+// --grid=RxC lays out R*C intersections; node r*C + c is at row r (0 = north)
+// and column c (0 = west). A car leaving a node heading h reaches the
+// neighbouring node in direction h link_time seconds later and arrives on
+// its approach h. Cars enter at the boundary heading inward and use XY
+// routing: along their row to the destination column, then along that
+// column. At the destination they make their final turn and leave. Since
+// every car starts at the edge it never needs a U-turn.
+
+int grid_nodes() {
+    return cfg->grid.rows * cfg->grid.cols;
+}
+
+// Node reached by leaving node n heading h, or -1 off the edge.
+int grid_neighbor(int n, int h) {
+    int r = n / cfg->grid.cols, c = n % cfg->grid.cols;
+    switch (h) {
+        case DIR_N: r--; break;
+        case DIR_E: c++; break;
+        case DIR_S: r++; break;
+        case DIR_W: c--; break;
     }
+    if (r < 0 || r >= cfg->grid.rows || c < 0 || c >= cfg->grid.cols) return -1;
+    return r * cfg->grid.cols + c;
 }
 
-// Unlock quadrants in reverse order.
-void unlock_quads(int q[], int n) {
-    for (int i = n - 1; i >= 0; i--) {
-        Pthread_mutex_unlock(&quad[q[i]]);
+// Set c->dirs.dir_target for the movement at c->node.
+void grid_route(car_t *c) {
+    int h = dir_index(c->dirs.dir_original);
+    int r = c->node / cfg->grid.cols, col = c->node % cfg->grid.cols;
+    int dr = c->dest / cfg->grid.cols, dc = c->dest % cfg->grid.cols;
+    int t;
+    if (c->node == c->dest) {
+        t = c->final_turn == LEFT_T ? (h + 3) % 4 : c->final_turn == RIGHT_T ? (h + 1) % 4 : h;
+    } else if (col != dc) {
+        t = dc > col ? DIR_E : DIR_W;
+    } else {
+        t = dr > r ? DIR_S : DIR_N;
     }
+    assert(t != (h + 2) % 4); // no U-turns
+    c->dirs.dir_target = dir_chars[t];
 }
 
-// Car actions ------------------------------------------------------------------
+// Move c on to its next intersection, arriving at time t; return 0 if it
+// has reached its destination and leaves the grid.
+int grid_advance(car_t *c, double t) {
+    if (c->node == c->dest) return 0;
+    int h = dir_index(c->dirs.dir_target);
+    c->node = grid_neighbor(c->node, h);
+    assert(c->node >= 0);
+    c->dirs.dir_original = c->dirs.dir_target;
+    c->arrival_time = t;
+    return 1;
+}
 
-void ArriveIntersection(car_t *c);
-void CrossIntersection(car_t *c);
-void ExitIntersection(car_t *c);
+// Event log --------------------------------------------------------------------
 
-// ARRIVE: head-of-line + direction/flow logic
-void ArriveIntersection(car_t *c) {
-    int d = dir_index(c->dirs.dir_original);
+// Logged car events
+typedef enum {LOG_ARRIVING, LOG_CROSSING, LOG_EXITING} log_kind_t;
 
-    log_event("arriving", c);
+const char *log_kind_names[] = {"arriving", "crossing", "exiting"};
 
-    // stop at stop sign for 2 seconds
-    usleep(2000000);
+// One log line, copied out of the car so it can outlive the car record.
+typedef struct {
+    double t;            // seconds since start
+    log_kind_t kind;
+    int cid;
+    directions dirs;
+    int node;            // intersection (grid runs)
+} log_rec_t;
 
-    // Wait until this car is head-of-line for its direction
-    sem_wait(&hol_sem[d]);
+// Format one log line as text.
+void print_log_rec(const log_rec_t *r) {
+    printf("Time %.1f: Car %d (%c %c) %s",
+           r->t,
+           r->cid,
+           r->dirs.dir_original,
+           r->dirs.dir_target,
+           log_kind_names[r->kind]);
+    if (cfg->grid_on) printf(" at (%d,%d)", r->node / cfg->grid.cols, r->node % cfg->grid.cols);
+    putchar('\n');
+}
 
-    // Now coordinate with other directions
-    Pthread_mutex_lock(&turn_lock);
+// Binary trace -------------------------------------------------------------------
+// --trace writes every logged event as a fixed-size record, alongside (or,
+// with --quiet, instead of) the text log:
+//
+//   trace_header_t, then one of
+//   - plain:      trace_rec_t records back to back
+//   - compressed: blocks of up to TRACE_BLOCK records, each a
+//                 {uint32 count, uint32 bytes} header followed by the records
+//                 as varints: zigzag delta of ts_ns, zigzag delta of cid,
+//                 then dirs, kind and quad_mask as single bytes
+//
+// --decode-trace turns either form back into the text log.
+
+#define TRACE_MAGIC   "\x7fTCT"
+#define TRACE_VERSION 1
+#define TRACE_COMPRESSED 1u   // trace_header_t.flags
+#define TRACE_BLOCK   4096
+
+typedef struct {
+    char magic[4];
+    uint32_t version;
+    uint32_t flags;
+    uint32_t rec_size;        // sizeof(trace_rec_t)
+} trace_header_t;
+
+typedef struct {
+    uint64_t ts_ns;           // nanoseconds since start
+    uint32_t cid;
+    uint8_t dirs;             // dir_index(orig) * 4 + dir_index(target)
+    uint8_t kind;             // log_kind_t
+    uint8_t quad_mask;        // quadrants the movement uses
+    uint8_t pad;
+} trace_rec_t;                // 16 bytes
+
+typedef struct {
+    FILE *fp;
+    int compressed;
+    trace_rec_t *block;       // records waiting to be written
+    int nblock;
+    uint8_t *buf;             // encoded block (compressed mode)
+} trace_t;
+
+trace_t trace;                // written by whoever prints log records
+int log_quiet;                // suppress the text log
 
-    // If another direction currently owns the intersection, wait.
-    while (current_direction != -1 && current_direction != d) {
-        pthread_cond_wait(&turn_cv, &turn_lock);
+void trace_open(const char *path, int compressed) {
+    trace.fp = fopen(path, "wb");
+    if (trace.fp == NULL) {
+        perror(path);
+        exit(1);
     }
+    trace.compressed = compressed;
+    trace.block = malloc(TRACE_BLOCK * sizeof(trace_rec_t));
+    trace.buf = malloc(TRACE_BLOCK * 3 * 10); // upper bound for varints
+    assert(trace.block != NULL && trace.buf != NULL);
+    trace.nblock = 0;
 
-    // At this point either intersection is free (-1) or already serving our direction
-    if (current_direction == -1) {
-        current_direction = d;   // take ownership
-        flow_count[d] = 1;
-    } else { // current_direction == d
-        flow_count[d]++;         // join existing flow for our direction
+    trace_header_t h = {{0}, TRACE_VERSION, compressed ? TRACE_COMPRESSED : 0, sizeof(trace_rec_t)};
+    memcpy(h.magic, TRACE_MAGIC, 4);
+    fwrite(&h, sizeof(h), 1, trace.fp);
+}
+
+uint8_t *put_varint(uint8_t *p, uint64_t v) {
+    while (v >= 0x80) {
+        *p++ = (uint8_t)(v | 0x80);
+        v >>= 7;
+    }
+    *p++ = (uint8_t)v;
+    return p;
+}
+
+uint64_t zigzag(int64_t v) {
+    return ((uint64_t)v << 1) ^ (uint64_t)(v >> 63);
+}
+
+void trace_flush_block() {
+    if (trace.nblock == 0) return;
+    if (!trace.compressed) {
+        fwrite(trace.block, sizeof(trace_rec_t), trace.nblock, trace.fp);
+    } else {
+        uint8_t *p = trace.buf;
+        uint64_t ts = 0;
+        int64_t cid = 0;
+        for (int i = 0; i < trace.nblock; i++) {
+            trace_rec_t *r = &trace.block[i];
+            p = put_varint(p, zigzag((int64_t)(r->ts_ns - ts)));
+            p = put_varint(p, zigzag((int64_t)r->cid - cid));
+            *p++ = r->dirs;
+            *p++ = r->kind;
+            *p++ = r->quad_mask;
+            ts = r->ts_ns;
+            cid = r->cid;
+        }
+        uint32_t hdr[2] = {(uint32_t)trace.nblock, (uint32_t)(p - trace.buf)};
+        fwrite(hdr, sizeof(hdr), 1, trace.fp);
+        fwrite(trace.buf, 1, p - trace.buf, trace.fp);
     }
+    trace.nblock = 0;
+}
 
-    Pthread_mutex_unlock(&turn_lock);
+void trace_add(const log_rec_t *r) {
+    int o = dir_index(r->dirs.dir_original);
+    int t = dir_index(r->dirs.dir_target);
+    trace_rec_t *out = &trace.block[trace.nblock++];
+    out->ts_ns = (uint64_t)llround(r->t * 1e9);
+    out->cid = (uint32_t)r->cid;
+    out->dirs = (uint8_t)(o * 4 + t);
+    out->kind = (uint8_t)r->kind;
+    out->quad_mask = (uint8_t)move_table[o][t].mask;
+    out->pad = 0;
+    if (trace.nblock == TRACE_BLOCK) trace_flush_block();
 }
 
-// CROSS: lock quadrants, simulate crossing, unlock quadrants
-void CrossIntersection(car_t *c) {
-    int q[4];
-    int n = get_quads(c, q);
+void trace_close() {
+    if (trace.fp == NULL) return;
+    trace_flush_block();
+    if (fclose(trace.fp) != 0) perror("trace");
+    free(trace.block);
+    free(trace.buf);
+    trace.fp = NULL;
+}
 
-    lock_quads(q, n);
+int get_varint(const uint8_t **p, const uint8_t *end, uint64_t *v) {
+    *v = 0;
+    for (int shift = 0; *p < end && shift < 64; shift += 7) {
+        uint8_t b = *(*p)++;
+        *v |= (uint64_t)(b & 0x7f) << shift;
+        if (!(b & 0x80)) return 1;
+    }
+    return 0;
+}
 
-    log_event("crossing", c);
+// Print a trace file in the text log format; return 0 on success.
+int decode_trace(const char *path) {
+    FILE *fp = strcmp(path, "-") == 0 ? stdin : fopen(path, "rb");
+    if (fp == NULL) {
+        perror(path);
+        return 1;
+    }
 
-    // Simulate crossing time depending on turn type:
-    // left:  5 seconds
-    // straight: 4 seconds
-    // right: 3 seconds
-    turn_t t = get_turn(&c->dirs);
-    if (t == LEFT_T) {
-        Spin(5);
-    } else if (t == STRAIGHT_T) {
-        Spin(4);
-    } else {
-        Spin(3);
+    trace_header_t h;
+    if (fread(&h, sizeof(h), 1, fp) != 1 || memcmp(h.magic, TRACE_MAGIC, 4) != 0 ||
+        h.version != TRACE_VERSION || h.rec_size != sizeof(trace_rec_t)) {
+        fprintf(stderr, "%s: not a version %d trace\n", path, TRACE_VERSION);
+        return 1;
     }
 
-    unlock_quads(q, n);
+    trace_rec_t *recs = malloc(TRACE_BLOCK * sizeof(trace_rec_t));
+    uint8_t *buf = NULL;
+    size_t buf_cap = 0;
+    assert(recs != NULL);
+    int rc = 0;
+
+    for (;;) {
+        size_t n;
+        if (!(h.flags & TRACE_COMPRESSED)) {
+            n = fread(recs, sizeof(trace_rec_t), TRACE_BLOCK, fp);
+        } else {
+            uint32_t hdr[2];
+            if (fread(hdr, sizeof(hdr), 1, fp) != 1) break;
+            if (hdr[0] > TRACE_BLOCK) { rc = 1; break; }
+            if (hdr[1] > buf_cap) {
+                buf_cap = hdr[1];
+                buf = realloc(buf, buf_cap);
+                assert(buf != NULL);
+            }
+            if (fread(buf, 1, hdr[1], fp) != hdr[1]) { rc = 1; break; }
+
+            const uint8_t *p = buf, *end = buf + hdr[1];
+            uint64_t ts = 0;
+            int64_t cid = 0;
+            for (n = 0; n < hdr[0]; n++) {
+                uint64_t dts, dcid;
+                if (!get_varint(&p, end, &dts) || !get_varint(&p, end, &dcid) || end - p < 3) {
+                    rc = 1;
+                    break;
+                }
+                ts += (uint64_t)((int64_t)(dts >> 1) ^ -(int64_t)(dts & 1));
+                cid += (int64_t)(dcid >> 1) ^ -(int64_t)(dcid & 1);
+                recs[n].ts_ns = ts;
+                recs[n].cid = (uint32_t)cid;
+                recs[n].dirs = *p++;
+                recs[n].kind = *p++;
+                recs[n].quad_mask = *p++;
+            }
+            if (rc) break;
+        }
+        if (n == 0) break;
+
+        for (size_t i = 0; i < n; i++) {
+            if (recs[i].kind > LOG_EXITING || recs[i].dirs > 15) { rc = 1; break; }
+            log_rec_t r;
+            r.t = (double)recs[i].ts_ns / 1e9;
+            r.kind = (log_kind_t)recs[i].kind;
+            r.cid = (int)recs[i].cid;
+            r.dirs.dir_original = dir_chars[recs[i].dirs / 4];
+            r.dirs.dir_target = dir_chars[recs[i].dirs % 4];
+            r.node = 0;
+            print_log_rec(&r);
+        }
+        if (rc) break;
+    }
+    if (rc) fprintf(stderr, "%s: corrupt trace\n", path);
+
+    free(recs);
+    free(buf);
+    if (fp != stdin) fclose(fp);
+    return rc;
 }
 
-// EXIT: log exit and update flow control
-void ExitIntersection(car_t *c) {
-    int d = dir_index(c->dirs.dir_original);
+// Deliver one record to the text log and/or the trace (caller holds
+// print_lock, or is the asynchronous writer).
+void emit_log_rec(const log_rec_t *r) {
+    if (!log_quiet) print_log_rec(r);
+    if (trace.fp != NULL) trace_add(r);
+}
+
+// Emit a batch of log records and flush once (caller holds print_lock).
+void print_log_batch(const log_rec_t *r, int n) {
+    for (int i = 0; i < n; i++) {
+        emit_log_rec(&r[i]);
+    }
+    if (n > 0 && !log_quiet) fflush(stdout);
+}
 
-    log_event("exiting", c);
+// Asynchronous logger ------------------------------------------------------------
+// With LOG_ASYNC, producers never touch print_lock or stdout. Each thread
+// appends records to its own single-producer/single-consumer ring, and one
+// background writer drains all rings, merges by timestamp, and prints in
+// batches.
+//
+// Ordering: each ring publishes a floor (no record it will still publish is
+// older than this). It is 0 while the producer is reading the clock, the
+// record's time while the record is in flight, and +inf when idle. Each
+// round the writer takes cut = min(its own clock, every floor), prints only
+// records older than cut, and holds the rest until the next round. So every
+// record comes out in timestamp order (ties: ring, then production order).
+// The floor protocol needs a shared monotonic timeline; in virtual-time runs
+// there is a single producer, whose records are already in order.
 
-    Pthread_mutex_lock(&turn_lock);
+typedef enum {LOG_SYNC, LOG_ASYNC} log_mode_t;
+log_mode_t log_mode = LOG_SYNC;
 
-    flow_count[d]--;
+// Records per producer ring (power of two). Rings come from calloc, so a car
+// thread that logs three lines only touches the first page. Rings whose
+// thread has exited are kept for the next thread rather than freed; their
+// head/tail keep counting, so a reused ring's records still sort after its
+// previous owner's.
+#define LOG_RING_SIZE 4096
 
-    // if no more cars from this direction in intersection,
-    // release ownership and wake all waiting directions
-    if (flow_count[d] == 0) {
-        current_direction = -1; // intersection becomes free
-        pthread_cond_broadcast(&turn_cv); // wake all waiting directions
+typedef struct log_ring {
+    _Alignas(64) _Atomic uint64_t head;   // next slot to fill (producer)
+    _Alignas(64) _Atomic uint64_t tail;   // next slot to drain (writer)
+    _Alignas(64) _Atomic double floor;    // see above
+    _Atomic int retired;                  // owning thread has exited
+    int id;                               // tie-breaker in the merge
+    struct log_ring *next_ring;           // registry link
+    log_rec_t slots[LOG_RING_SIZE];
+} log_ring_t;
+
+// Registry of all rings: producers push at the head with a CAS; only the
+// writer unlinks (never the current head), so the list needs no lock.
+_Atomic(log_ring_t *) log_rings;
+_Atomic int log_ring_ids;
+_Thread_local log_ring_t *my_log_ring;
+
+// Drained rings of exited threads, linked through next_ring.
+log_ring_t *log_spare_rings;
+pthread_mutex_t log_spare_lock = PTHREAD_MUTEX_INITIALIZER;
+
+pthread_t log_writer;
+_Atomic int log_stopping;
+int log_virtual_time;        // timestamps come from a virtual clock
+
+log_ring_t *log_get_ring() {
+    log_ring_t *r = my_log_ring;
+    if (r == NULL) {
+        Pthread_mutex_lock(&log_spare_lock);
+        r = log_spare_rings;
+        if (r != NULL) log_spare_rings = r->next_ring;
+        Pthread_mutex_unlock(&log_spare_lock);
+        if (r == NULL) {
+            r = calloc(1, sizeof(log_ring_t));
+            assert(r != NULL);
+            r->id = atomic_fetch_add(&log_ring_ids, 1);
+        }
+        atomic_store(&r->retired, 0);
+        atomic_store(&r->floor, INFINITY);
+        log_ring_t *head = atomic_load(&log_rings);
+        do {
+            r->next_ring = head;
+        } while (!atomic_compare_exchange_weak(&log_rings, &head, r));
+        my_log_ring = r;
     }
+    return r;
+}
 
-    Pthread_mutex_unlock(&turn_lock);
+// Call before reading the clock for a record that will be logged.
+void log_hold() {
+    if (log_mode == LOG_ASYNC) atomic_store(&log_get_ring()->floor, 0.0);
+}
 
-    // Release head-of-line lock so next car from this direction
-    // can move up to the stop sign
-    sem_post(&hol_sem[d]);
+// Call with the timestamp just read, once it is known.
+void log_stamped(double t) {
+    if (log_mode == LOG_ASYNC) atomic_store(&log_get_ring()->floor, t);
 }
 
-// Car thread ------------------------------------------------------------
-// The thread sleeps until arrival time,
-// then performs ARRIVE → CROSS → EXIT in order.
+// Hand n records to the logger. Synchronous mode prints them under print_lock;
+// asynchronous mode copies them into this thread's ring and returns.
+void log_submit(const log_rec_t *recs, int n) {
+    if (log_mode == LOG_SYNC) {
+        if (log_quiet && trace.fp == NULL) return;  // nobody would see them
+        STAT_MUTEX_LOCK(&print_lock, &print_lock_stats);
+        print_log_batch(recs, n);
+        Pthread_mutex_unlock(&print_lock);
+        return;
+    }
 
-void *Car(void *arg) {
-    car_t *c = (car_t *)arg;
+    log_ring_t *r = log_get_ring();
+    uint64_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+    for (int i = 0; i < n; i++) {
+        // a full ring waits for the writer to drain memory, never for I/O
+        while (head - atomic_load_explicit(&r->tail, memory_order_acquire) == LOG_RING_SIZE) {
+            sched_yield();
+        }
+        r->slots[head & (LOG_RING_SIZE - 1)] = recs[i];
+        head++;
+        atomic_store_explicit(&r->head, head, memory_order_release);
+    }
+    atomic_store(&r->floor, INFINITY);
+}
 
-    // sleep until its arrival time
-    unsigned int us = (unsigned int)(c->arrival_time * 1000000.0);
-    usleep(us);
+// The calling thread will log no more; its ring is freed once drained.
+void log_thread_done() {
+    if (my_log_ring != NULL) {
+        atomic_store(&my_log_ring->retired, 1);
+        my_log_ring = NULL;
+    }
+}
+
+// A drained record plus its merge key.
+typedef struct {
+    log_rec_t rec;
+    int ring;
+    uint64_t seq;
+} log_item_t;
+
+int log_item_cmp(const void *a, const void *b) {
+    const log_item_t *x = a, *y = b;
+    if (x->rec.t != y->rec.t) return x->rec.t < y->rec.t ? -1 : 1;
+    if (x->ring != y->ring) return x->ring < y->ring ? -1 : 1;
+    return x->seq < y->seq ? -1 : x->seq > y->seq;
+}
+
+void *LogWriter(void *arg) {
+    (void)arg;
+    log_item_t *pend = NULL;   // drained but not yet printed
+    int npend = 0, cap = 0;
+
+    for (;;) {
+        int stopping = atomic_load(&log_stopping);
+
+        // 1. cut = min(our clock, every producer's floor)
+        double cut = (log_virtual_time || stopping) ? INFINITY : now();
+        for (log_ring_t *r = atomic_load(&log_rings); r; r = r->next_ring) {
+            double f;
+            while ((f = atomic_load(&r->floor)) == 0.0) {
+                sched_yield(); // producer is mid clock read: nanoseconds
+            }
+            if (f < cut) cut = f;
+        }
+
+        // 2. drain every ring, unlinking retired rings that are now empty
+        log_ring_t *prev = NULL;
+        for (log_ring_t *r = atomic_load(&log_rings); r; ) {
+            int retired = atomic_load(&r->retired);
+            uint64_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+            uint64_t head = atomic_load_explicit(&r->head, memory_order_acquire);
+            for (; tail != head; tail++) {
+                if (npend == cap) {
+                    cap = cap ? cap * 2 : 1024;
+                    pend = realloc(pend, cap * sizeof(log_item_t));
+                    assert(pend != NULL);
+                }
+                pend[npend].rec = r->slots[tail & (LOG_RING_SIZE - 1)];
+                pend[npend].ring = r->id;
+                pend[npend].seq = tail;
+                npend++;
+            }
+            atomic_store_explicit(&r->tail, tail, memory_order_release);
+
+            log_ring_t *next = r->next_ring;
+            if (retired && prev != NULL) { // head is never unlinked
+                prev->next_ring = next;
+                Pthread_mutex_lock(&log_spare_lock);
+                r->next_ring = log_spare_rings;
+                log_spare_rings = r;
+                Pthread_mutex_unlock(&log_spare_lock);
+            } else {
+                prev = r;
+            }
+            r = next;
+        }
+
+        // 3. print everything older than cut as one batch
+        qsort(pend, npend, sizeof(log_item_t), log_item_cmp);
+        int n = 0;
+        while (n < npend && pend[n].rec.t < cut) {
+            emit_log_rec(&pend[n].rec);
+            n++;
+        }
+        if (n > 0 && !log_quiet) fflush(stdout);
+        memmove(pend, pend + n, (npend - n) * sizeof(log_item_t));
+        npend -= n;
 
-    // Perform the three actions in order
-    ArriveIntersection(c);
-    CrossIntersection(c);
-    ExitIntersection(c);
+        if (stopping && npend == 0) break;
+        if (n == 0) usleep(1000);
+    }
 
+    free(pend);
+    Pthread_mutex_lock(&log_spare_lock);
+    while (log_spare_rings != NULL) {
+        log_ring_t *next = log_spare_rings->next_ring;
+        free(log_spare_rings);
+        log_spare_rings = next;
+    }
+    Pthread_mutex_unlock(&log_spare_lock);
     return NULL;
 }
 
+// Start the background writer if LOG_ASYNC is selected.
+void log_start(int virtual_time) {
+    if (log_mode != LOG_ASYNC) return;
+    log_virtual_time = virtual_time;
+    atomic_store(&log_stopping, 0);
+    Pthread_create(&log_writer, NULL, LogWriter, NULL);
+}
 
-// main -------------------------------------------------------------------
+// Flush every outstanding record and stop the writer.
+void log_stop() {
+    if (log_mode != LOG_ASYNC) return;
+    log_thread_done();
+    atomic_store(&log_stopping, 1);
+    Pthread_join(log_writer, NULL);
+}
 
-int main() {
+// Log an event stamped with time t (seconds).
+void log_event_at(double t, log_kind_t kind, car_t *c) {
+    log_rec_t r = {t, kind, c->cid, c->dirs, c->node};
+    log_submit(&r, 1);
+}
 
-    /// Mark simulation start time
-    start_time = GetTime();
+// Log an event at the current wall-clock time, stamped at the call site;
+// returns the timestamp used.
+double log_event(log_kind_t kind, car_t *c) {
+    log_hold();
+    double t = now();
+    log_stamped(t);
+    log_event_at(t, kind, c);
+    return t;
+}
 
-    // Initialize print mutex
-    Pthread_mutex_init(&print_lock, NULL);
-    for (int i = 0; i < 4; i++) {
-        Pthread_mutex_init(&quad[i], NULL);
+// One quadrant mutex per cache line: cars crossing different quadrants of
+// an intersection never write to the same line.
+typedef struct {
+    _Alignas(64) pthread_mutex_t m;
+} quad_lock_t;
+
+// Lock quadrants in sorted order to avoid circular wait (c and v are for the
+// verifier).
+void lock_quads(quad_lock_t quad[], int q[], int n, verify_t *v, car_t *c) {
+    for (int i = 0; i < n; i++) {
+        VERIFY(verify_lock(v, c, q[i]));
+        STAT_MUTEX_LOCK(&quad[q[i]].m, &quad_stats[q[i]]);
+        VERIFY(verify_locked(v, c, q[i]));
     }
-    
-    // Initialize turn control mutex and condition variable
-    Pthread_mutex_init(&turn_lock, NULL);
-    pthread_cond_init(&turn_cv, NULL);
+}
 
-    // Initialize per-direction head-of-line semaphores
-    for (int i = 0; i < 4; i++) {
-        sem_init(&hol_sem[i], 0, 1);  // head-of-line token per direction
+// Unlock quadrants in reverse order.
+void unlock_quads(quad_lock_t quad[], int q[], int n, verify_t *v, car_t *c) {
+    for (int i = n - 1; i >= 0; i--) {
+        VERIFY(verify_unlock(v, c, q[i]));
+        Pthread_mutex_unlock(&quad[q[i]].m);
     }
+}
 
-    // Create car threads
-    pthread_t tids[NUM_CARS];
+// Atomic quadrant reservation -----------------------------------------------------
+// Alternative to the per-quadrant mutexes: one occupancy word where bit i is
+// set while quad i is in use. A car claims all of its bits with a single CAS
+// or sleeps on the word until they are all free, so it never holds quad 1
+// while blocking on quad 2. (The word is 32 bits because futexes are.)
 
-    // Create one thread for each car
-    for (int i = 0; i < NUM_CARS; i++) {
-        Pthread_create(&tids[i], NULL, Car, &cars[i]);
+typedef struct {
+    _Atomic uint32_t word;      // bit i set while quad i is occupied
+    _Atomic uint32_t waiters;   // threads sleeping on word
+} quad_mask_t;
+
+void lock_quad_mask(quad_mask_t *qm, uint32_t m) {
+#ifdef TC_LOCK_STATS
+    uint64_t blocked_since = 0;
+#endif
+    uint32_t cur = atomic_load_explicit(&qm->word, memory_order_relaxed);
+    for (;;) {
+        if ((cur & m) == 0) {
+            if (atomic_compare_exchange_weak_explicit(&qm->word, &cur, cur | m,
+                                                      memory_order_acquire,
+                                                      memory_order_relaxed)) {
+                STAT_MASK_ACQUIRED(blocked_since);
+                return;
+            }
+            continue; // cur was refreshed by the failed CAS
+        }
+        // Some of our bits are taken: sleep until the word changes. The
+        // waiter count is raised first so unlock_quad_mask never skips the
+        // wake; if the word already moved on, Futex_wait returns at once.
+        STAT_MASK_BLOCKED(blocked_since);
+        atomic_fetch_add(&qm->waiters, 1);
+        Futex_wait(&qm->word, cur);
+        atomic_fetch_sub(&qm->waiters, 1);
+        cur = atomic_load_explicit(&qm->word, memory_order_relaxed);
     }
+}
 
-    // Wait for all cars to finish
-    for (int i = 0; i < NUM_CARS; i++) {
-        Pthread_join(tids[i], NULL);
+void unlock_quad_mask(quad_mask_t *qm, uint32_t m) {
+    atomic_fetch_and_explicit(&qm->word, ~m, memory_order_release);
+    if (atomic_load(&qm->waiters) > 0) {
+        Futex_wake_all(&qm->word); // waiters want different bits: wake all
+    }
+}
+
+// FIFO list of waiting cars (intrusive through car_t.next).
+typedef struct {
+    car_t *head;
+    car_t *tail;
+} car_list_t;
+
+void cl_push(car_list_t *l, car_t *c) {
+    c->next = NULL;
+    if (l->tail) l->tail->next = c;
+    else         l->head = c;
+    l->tail = c;
+}
+
+car_t *cl_pop(car_list_t *l) {
+    car_t *c = l->head;
+    if (c) {
+        l->head = c->next;
+        if (!l->head) l->tail = NULL;
+        c->next = NULL;
+    }
+    return c;
+}
+
+// Conflict-matrix admission ------------------------------------------------------
+// Alternative to the single current_direction token: a car is admitted when
+// its movement shares no quadrant with any movement already admitted, so e.g.
+// a N->E right turn (quad 1) and a S->W right turn (quad 3) cross together.
+// Quadrant locks still provide safety; the gate only decides who may try.
+//
+// Starvation bound: each waiting car counts how often a later, conflicting
+// car was admitted ahead of it. Once that reaches starve_limit, no further
+// car that conflicts with it is admitted until it gets in, so every car is
+// overtaken at most starve_limit times.
+
+// Cars admitted or waiting under ADMIT_CONFLICT. The pthread version keeps one
+// under turn_lock; the event engines keep one per simulation.
+typedef struct {
+    int active[NUM_MOVES];     // admitted cars per movement, not yet exited
+    car_list_t waiting;        // cars waiting to be admitted, oldest first
+} conflict_gate_t;
+
+void gate_enqueue(conflict_gate_t *g, car_t *c) {
+    c->bypassed = 0;
+    c->admitted = 0;
+    cl_push(&g->waiting, c);
+}
+
+// Can waiting car c be admitted now?
+int gate_admissible(conflict_gate_t *g, car_t *c) {
+    int m = movement_id(&c->dirs);
+    for (int k = 0; k < NUM_MOVES; k++) {
+        if (g->active[k] > 0 && movement_conflict[m][k]) return 0;
     }
+    // don't overtake an older conflicting car that has hit the limit
+    for (car_t *w = g->waiting.head; w != NULL && w != c; w = w->next) {
+        if (w->bypassed >= cfg->starve_limit &&
+            movement_conflict[m][movement_id(&w->dirs)]) return 0;
+    }
+    return 1;
+}
+
+// Move c from waiting to active, charging every older car it overtakes.
+void gate_admit(conflict_gate_t *g, car_t *c) {
+    int m = movement_id(&c->dirs);
+    car_t *prev = NULL;
+    for (car_t *w = g->waiting.head; w != c; prev = w, w = w->next) {
+        assert(w != NULL);
+        if (movement_conflict[m][movement_id(&w->dirs)]) w->bypassed++;
+    }
+    if (prev) prev->next = c->next;
+    else      g->waiting.head = c->next;
+    if (g->waiting.tail == c) g->waiting.tail = prev;
+    c->next = NULL;
+    c->admitted = 1;
+    g->active[m]++;
+}
+
+void gate_release(conflict_gate_t *g, car_t *c) {
+    g->active[movement_id(&c->dirs)]--;
+}
+
+// Scheduling policies -------------------------------------------------------------
+// Decide who gets the intersection when it changes hands (targeted wakeups
+// only; POLICY_RACE is the broadcast free-for-all):
+//   rr         next waiting approach clockwise from the one that just left
+//   lqf        approach with the most cars not yet admitted
+//   oldest     approach whose waiting car arrived first
+//   maxweight  largest total queue depth over a set of mutually compatible
+//              movements; under direction admission a set is one approach,
+//              so this picks the same as lqf
+// Ties go to round-robin order. Under direction admission flow_cap bounds how
+// many cars one grant may admit while another approach is waiting.
+
+// What a policy sees at a handover.
+typedef struct {
+    car_t *head[4];  // car waiting at the gate on each approach, or NULL
+    long depth[4];   // cars on each approach not yet admitted
+    int from;        // approach that just released the intersection
+} sched_view_t;
+
+// Fill v->head from the cars waiting at a conflict gate.
+void sched_gate_heads(sched_view_t *v, conflict_gate_t *g) {
+    for (car_t *w = g->waiting.head; w != NULL; w = w->next) {
+        v->head[dir_index(w->dirs.dir_original)] = w;
+    }
+}
+
+// Is approach a strictly preferable to b (both have a car waiting)?
+int sched_better(const sched_view_t *v, int a, int b) {
+    switch (cfg->sched_policy) {
+    case POLICY_LQF:
+    case POLICY_MAXWEIGHT:
+        return v->depth[a] > v->depth[b];
+    case POLICY_OLDEST:
+        return v->head[a]->arrival_time < v->head[b]->arrival_time;
+    default:
+        return 0;
+    }
+}
+
+// Direction admission: approach to grant next, or -1 if nobody waits.
+// 'capped' means v->from used up its flow_cap and should yield if it can.
+int sched_pick(const sched_view_t *v, int capped) {
+    int best = -1;
+    for (int k = 1; k <= 4; k++) {
+        int d = (v->from + k) % 4;
+        if (v->head[d] == NULL) continue;
+        if (capped && d == v->from && best != -1) continue;
+        if (best == -1 || sched_better(v, d, best)) best = d;
+    }
+    return best;
+}
+
+// Conflict admission: admit waiting cars chosen by the policy, storing them in
+// out[] (at most one per approach). Returns how many were admitted.
+int sched_admit(conflict_gate_t *g, const sched_view_t *v, car_t *out[4]) {
+    int n = 0;
+
+    if (cfg->sched_policy == POLICY_MAXWEIGHT) {
+        // candidates in round-robin order, starting after v->from
+        car_t *cand[4];
+        int nc = 0;
+        for (int k = 1; k <= 4; k++) {
+            car_t *w = v->head[(v->from + k) % 4];
+            if (w != NULL && gate_admissible(g, w)) cand[nc++] = w;
+        }
+        // every subset of at most 4 candidates: keep the heaviest compatible
+        // one; of equal weights, the one with the earliest candidate where
+        // they first differ (the lowest bit of set ^ best_set is in set)
+        int best_set = 0;
+        long best_weight = -1;
+        for (int set = 1; set < (1 << nc); set++) {
+            long weight = 0;
+            int ok = 1;
+            for (int i = 0; i < nc && ok; i++) {
+                if (!(set & (1 << i))) continue;
+                weight += v->depth[dir_index(cand[i]->dirs.dir_original)];
+                for (int j = i + 1; j < nc; j++) {
+                    if ((set & (1 << j)) &&
+                        movement_conflict[movement_id(&cand[i]->dirs)][movement_id(&cand[j]->dirs)]) {
+                        ok = 0;
+                        break;
+                    }
+                }
+            }
+            int diff = set ^ best_set;
+            if (ok && (weight > best_weight ||
+                       (weight == best_weight && (set & diff & -diff)))) {
+                best_weight = weight;
+                best_set = set;
+            }
+        }
+        for (int i = 0; i < nc; i++) {
+            if ((best_set & (1 << i)) && gate_admissible(g, cand[i])) {
+                gate_admit(g, cand[i]);
+                out[n++] = cand[i];
+            }
+        }
+        return n;
+    }
+
+    // greedy: admit the preferred admissible car until none is left
+    for (;;) {
+        car_t *pick = NULL;
+        int pd = -1;
+        for (int k = 1; k <= 4; k++) {
+            int d = (v->from + k) % 4;
+            car_t *w = v->head[d];
+            if (w == NULL || w->admitted || !gate_admissible(g, w)) continue;
+            if (pick == NULL || sched_better(v, d, pd)) {
+                pick = w;
+                pd = d;
+            }
+        }
+        if (pick == NULL) return n;
+        gate_admit(g, pick);
+        out[n++] = pick;
+    }
+}
+
+// Signal control ------------------------------------------------------------------
+// With --signal every intersection is a traffic light instead of an all-way
+// stop. Cars don't stop: the head-of-line car on an approach goes as soon as
+// its movement is green in the current phase, and waits through red. The
+// light replaces the direction/conflict gate; quadrant locks still separate
+// movements one phase lets through together (the two opposing lefts, say).
+// The phases come from --phases and run
+//   fixed     each for its planned time, in order
+//   actuated  for SIGNAL_MIN_GREEN plus SIGNAL_EXTEND per car queued on its
+//             movements when it starts, up to its planned time; phases
+//             nobody waits for are skipped, and with nobody waiting at all
+//             the light rests until a car arrives at a red
+//   pressure  max-pressure control: every SIGNAL_MIN_GREEN the phase with
+//             the most pressure (cars queued on its movements, plus the
+//             head-of-line waits of those movements at one car per
+//             SIGNAL_AGE seconds) gets or keeps the green. A phase that has
+//             run its planned time yields if any other has pressure, so a
+//             heavy approach cannot hold a light one off indefinitely.
+//             Downstream queues are left out: on a grid they belong to a
+//             neighbour, which may be simulated by another thread.
+//
+// A light is advanced lazily: signal_advance replays its phase changes up to
+// the given time. Its queues only change when something happens at that
+// intersection, which advances it first, so the outcome does not depend on
+// when or by whom it is advanced. A timer is only needed while a car waits at
+// red: the event engines schedule EV_PHASE, and in the pthread version the
+// waiting cars sleep on their dir_cv until the change.
+
+#define SIGNAL_MIN_GREEN 5.0     // seconds
+#define SIGNAL_EXTEND    2.0     // seconds of green per queued car
+#define SIGNAL_AGE       10.0    // head-of-line wait that weighs one queued car
+
+typedef struct {
+    int phase;                   // index into cfg->phases
+    double start;                // when it turned green
+    double end;                  // next change (INFINITY while resting)
+    long demand[NUM_MOVES];      // cars arrived and not yet admitted, by movement
+    int hol_move[4];             // movement of each approach's head-of-line
+                                 // car waiting for green, or -1
+    double hol_since[4];         // when that car arrived
+} signal_t;
+
+int signal_green(const signal_t *sg, int m) {
+    return (cfg->phases[sg->phase].green >> m) & 1;
+}
+
+// Cars queued on the movements phase p gives green.
+long phase_demand(const signal_t *sg, int p) {
+    long n = 0;
+    for (int m = 0; m < NUM_MOVES; m++) {
+        if (cfg->phases[p].green & (1 << m)) n += sg->demand[m];
+    }
+    return n;
+}
+
+// Max-pressure weight of phase p at time t.
+double phase_pressure(const signal_t *sg, int p, double t) {
+    double w = (double)phase_demand(sg, p);
+    for (int d = 0; d < 4; d++) {
+        int m = sg->hol_move[d];
+        if (m >= 0 && (cfg->phases[p].green & (1 << m))) {
+            w += (t - sg->hol_since[d]) / SIGNAL_AGE;
+        }
+    }
+    return w;
+}
+
+// Turn phase p green at time t.
+void signal_start(signal_t *sg, int p, double t) {
+    double len = cfg->phases[p].time;
+    if (cfg->signal == SIGNAL_ACTUATED) {
+        double want = SIGNAL_MIN_GREEN + SIGNAL_EXTEND * phase_demand(sg, p);
+        if (want < len) len = want;
+    } else if (cfg->signal == SIGNAL_PRESSURE && SIGNAL_MIN_GREEN < len) {
+        len = SIGNAL_MIN_GREEN;  // decide again after one slot
+    }
+    sg->phase = p;
+    sg->start = t;
+    sg->end = t + len;
+}
+
+void signal_init(signal_t *sg) {
+    memset(sg, 0, sizeof(*sg));
+    for (int d = 0; d < 4; d++) sg->hol_move[d] = -1;
+    signal_start(sg, 0, 0);
+    if (cfg->signal == SIGNAL_ACTUATED || cfg->signal == SIGNAL_PRESSURE) {
+        sg->end = INFINITY;      // nobody waits yet
+    }
+}
+
+// Max-pressure decision at the end of a slot: keep the green, or move it.
+void signal_pressure_next(signal_t *sg, double t) {
+    int n = cfg->nphases, cur = sg->phase;
+    int capped = t - sg->start >= cfg->phases[cur].time;
+    int best = -1;
+    double best_w = 0;
+    for (int k = 0; k < n; k++) {
+        int p = (cur + k) % n;   // current first, so ties keep the green
+        if (p == cur && capped) continue;
+        double w = phase_pressure(sg, p, t);
+        if (w > best_w) {
+            best = p;
+            best_w = w;
+        }
+    }
+    if (best == -1 && phase_pressure(sg, cur, t) > 0) best = cur;  // only it waits
+    if (best == -1) {
+        sg->end = INFINITY;      // rest in this phase
+    } else if (best == cur && !capped) {
+        sg->end = t + SIGNAL_MIN_GREEN;
+    } else {
+        signal_start(sg, best, t);
+    }
+}
+
+// The current phase is over at time t: start the next one.
+void signal_next(signal_t *sg, double t) {
+    int n = cfg->nphases;
+    if (cfg->signal == SIGNAL_PRESSURE) {
+        signal_pressure_next(sg, t);
+        return;
+    }
+    if (cfg->signal != SIGNAL_ACTUATED) {
+        signal_start(sg, (sg->phase + 1) % n, t);
+        return;
+    }
+    for (int k = 1; k <= n; k++) {
+        int p = (sg->phase + k) % n;
+        if (phase_demand(sg, p) > 0) {
+            signal_start(sg, p, t);
+            return;
+        }
+    }
+    sg->end = INFINITY;          // rest in this phase
+}
+
+// Replay every phase change up to time t.
+void signal_advance(signal_t *sg, double t) {
+    while (sg->end <= t) signal_next(sg, sg->end);
+}
+
+// A car for movement m is head of line on its approach (m / 3), waiting
+// since time since (after signal_advance).
+void signal_hol(signal_t *sg, int m, double since) {
+    sg->hol_move[m / 3] = m;
+    sg->hol_since[m / 3] = since;
+}
+
+// A car for movement m arrived (delta 1, at time t, after signal_advance) or
+// was admitted (delta -1). Return 1 if that moved the next phase change.
+int signal_demand(signal_t *sg, int m, int delta, double t) {
+    sg->demand[m] += delta;
+    if (delta < 0) sg->hol_move[m / 3] = -1;  // only the head is admitted
+    if (delta < 0 || sg->end != INFINITY || signal_green(sg, m)) return 0;
+    // resting: change once the current phase has had its minimum green
+    double end = sg->start + SIGNAL_MIN_GREEN;
+    sg->end = end > t ? end : t;
+    signal_advance(sg, t);
+    return 1;
+}
+
+// Intersection state -------------------------------------------------------------
+// Everything the pthread version shares between the cars at one intersection.
+// A single intersection is isects[0]; --grid instantiates one per node.
+// Groups written by different cars at the same time start on their own
+// cache lines: each quadrant lock, the state under turn_lock, the lock-free
+// queue depths and each head-of-line queue.
+
+typedef struct {
+    // Quadrant locks: quad 0 = NW, 1 = NE, 2 = SE, 3 = SW (counter-clockwise)
+    quad_lock_t quad[4];
+    quad_mask_t quad_mask;      // used instead under QUADS_MASK
+
+    // Direction flow control
+    _Alignas(64) pthread_mutex_t turn_lock;  // protects everything down to gate
+    pthread_cond_t turn_cv;     // used to wake waiting directions when flow ends
+    int current_direction;      // -1 means no direction currently owns intersection
+    int flow_count[4];          // number of cars from each direction crossing
+    int flow_served;            // cars admitted since current_direction was granted
+
+    // Targeted wakeups: one condition variable per direction, so a handover
+    // wakes only the direction that was granted the intersection
+    pthread_cond_t dir_cv[4];
+    car_t *dir_waiter[4];       // car blocked on dir_cv[d] (the HOL token
+                                // allows at most one)
+    conflict_gate_t gate;       // used under ADMIT_CONFLICT
+    signal_t signal;            // used instead under --signal
+
+    _Alignas(64) _Atomic int queue_depth[4];  // cars arrived on each approach,
+                                              // not yet admitted
+
+    // Per-direction head-of-line queues
+    hol_queue_t hol[4];
+
+    verify_t verify;            // see "Safety verifier"
+} intersection_t;
+
+intersection_t *isects;
+int nisects;
+
+void isect_init(intersection_t *x) {
+    memset(x, 0, sizeof(*x));
+    for (int i = 0; i < 4; i++) {
+        Pthread_mutex_init(&x->quad[i].m, NULL);
+    }
+
+    // Initialize turn control mutex and condition variables
+    Pthread_mutex_init(&x->turn_lock, NULL);
+    pthread_cond_init(&x->turn_cv, NULL);
+    pthread_condattr_t mono;
+    pthread_condattr_init(&mono);
+    pthread_condattr_setclock(&mono, CLOCK_MONOTONIC);  // red lights time out
+    for (int i = 0; i < 4; i++) {
+        pthread_cond_init(&x->dir_cv[i], &mono);
+    }
+    pthread_condattr_destroy(&mono);
+    x->current_direction = -1;
+    signal_init(&x->signal);
+}
+
+// Latency metrics ----------------------------------------------------------------
+// With --latency every car stamps its phase boundaries (see car_t) and, on
+// exit, records its waits into histograms (microsecond resolution):
+//   wait       quadrants acquired - stop done: delay beyond the mandatory stop,
+//              split per approach and per turn type
+//   HOL wait   stop done -> head of line
+//   gate wait  head of line -> admitted by the direction/conflict gate
+//   quad wait  admitted -> holding every quadrant
+// Each thread records into its own lat_set_t without locking; sets are merged
+// when a car thread exits (or read directly from a simulation's own set).
+
+int latency_on;
+
+typedef struct lat_set {
+    hist_t by_dir[4];
+    hist_t by_turn[3];
+    hist_t hol_wait;
+    hist_t gate_wait;
+    hist_t quad_wait;
+    struct lat_set *next_spare;   // lat_spare link
+} lat_set_t;
+
+_Thread_local lat_set_t *my_lat;
+lat_set_t lat_total;          // merged sets of finished car threads
+lat_set_t *lat_spare;         // merged sets kept for the next thread
+pthread_mutex_t lat_lock = PTHREAD_MUTEX_INITIALIZER;
+
+uint64_t to_us(double seconds) {
+    return seconds > 0 ? (uint64_t)(seconds * 1e6 + 0.5) : 0;
+}
+
+void latency_record(lat_set_t *l, car_t *c) {
+    const movement_t *m = get_move(&c->dirs);
+    uint64_t wait = to_us(c->t_quads - c->t_stop);
+    HistRecord(&l->by_dir[m->id / 3], wait);
+    HistRecord(&l->by_turn[m->turn], wait);
+    HistRecord(&l->hol_wait, to_us(c->t_hol - c->t_stop));
+    HistRecord(&l->gate_wait, to_us(c->t_granted - c->t_hol));
+    HistRecord(&l->quad_wait, to_us(c->t_quads - c->t_granted));
+}
+
+// Record c into the calling thread's set.
+void latency_record_local(car_t *c) {
+    if (my_lat == NULL) {
+        Pthread_mutex_lock(&lat_lock);
+        my_lat = lat_spare;
+        if (my_lat != NULL) lat_spare = my_lat->next_spare;
+        Pthread_mutex_unlock(&lat_lock);
+        if (my_lat != NULL) memset(my_lat, 0, sizeof(*my_lat));
+        else                my_lat = calloc(1, sizeof(lat_set_t));
+        assert(my_lat != NULL);
+    }
+    latency_record(my_lat, c);
+}
+
+void latency_merge(lat_set_t *into, const lat_set_t *from) {
+    for (int d = 0; d < 4; d++) HistMerge(&into->by_dir[d], &from->by_dir[d]);
+    for (int t = 0; t < 3; t++) HistMerge(&into->by_turn[t], &from->by_turn[t]);
+    HistMerge(&into->hol_wait, &from->hol_wait);
+    HistMerge(&into->gate_wait, &from->gate_wait);
+    HistMerge(&into->quad_wait, &from->quad_wait);
+}
+
+// Fold the calling thread's set into lat_total (once per thread, off the
+// hot path) and keep it for the next thread.
+void latency_thread_done() {
+    if (my_lat == NULL) return;
+    Pthread_mutex_lock(&lat_lock);
+    latency_merge(&lat_total, my_lat);
+    my_lat->next_spare = lat_spare;
+    lat_spare = my_lat;
+    Pthread_mutex_unlock(&lat_lock);
+    my_lat = NULL;
+}
+
+void print_hist_row(const char *name, const hist_t *h) {
+    printf("  %-10s %8llu %9.3f %9.3f %9.3f %9.3f\n", name,
+           (unsigned long long)h->count,
+           HistQuantile(h, 0.50) / 1e6, HistQuantile(h, 0.90) / 1e6,
+           HistQuantile(h, 0.99) / 1e6, HistQuantile(h, 1.0) / 1e6);
+}
+
+void latency_report(const lat_set_t *l) {
+    static const char *dir_names[4] = {"N", "E", "S", "W"};
+    static const char *turn_names[3] = {"left", "straight", "right"};
+
+    hist_t all;
+    memset(&all, 0, sizeof(all));
+    for (int d = 0; d < 4; d++) HistMerge(&all, &l->by_dir[d]);
+
+    printf("Wait beyond the mandatory stop (seconds):\n");
+    printf("  %-10s %8s %9s %9s %9s %9s\n", "group", "cars", "p50", "p90", "p99", "max");
+    print_hist_row("all", &all);
+    for (int d = 0; d < 4; d++) print_hist_row(dir_names[d], &l->by_dir[d]);
+    for (int t = 0; t < 3; t++) print_hist_row(turn_names[t], &l->by_turn[t]);
+    printf("  phases:\n");
+    print_hist_row("HOL wait", &l->hol_wait);
+    print_hist_row("gate wait", &l->gate_wait);
+    print_hist_row("quad wait", &l->quad_wait);
+}
+
+// Live metrics -------------------------------------------------------------------
+// --metrics=FILE[,SECS] publishes a snapshot of the running simulation every
+// SECS wall-clock seconds (default 1) to FILE, a one-page shared-memory
+// segment (put it under /dev/shm to keep it off disk); --watch=FILE prints
+// the snapshots from another terminal as they come. Each one has cars/s
+// leaving intersections, the queue on each approach (over all
+// intersections), the share of time each quadrant was occupied, and the
+// wait beyond the stop at p50 and p99 over the last METRICS_WINDOW snapshots.
+//
+// Observing adds no shared writes on the hot path: every thread counts into
+// its own metrics_block_t, of which it is the only writer, so a count is a
+// plain load and store. A separate publisher thread sums the blocks without
+// taking any lock. turn_lock and print_lock are never involved, and
+// metrics_lock is only taken when a thread first counts and when it ends,
+// like lat_lock. The page is a seqlock: seq is odd while the publisher
+// writes it, and readers retry until they see the same even seq before and
+// after copying.
+
+#define METRICS_MAGIC   "\x7fTCM"
+#define METRICS_VERSION 1
+#define METRICS_WINDOW  10     // snapshots the wait percentiles cover
+#define METRICS_STALE   5      // snapshot intervals with none before --watch gives up
+#define METRICS_TRIES   1000   // seqlock retries before metrics_read gives up
+
+typedef struct metrics_block {
+    _Alignas(64) _Atomic uint64_t arrived[4];  // by approach
+    _Atomic uint64_t granted[4];       // admitted by the gate or light
+    _Atomic uint64_t exited;
+    // crossings started and finished on each quadrant, and the sums of their
+    // start and end times (us): how long quadrants were occupied up to any
+    // time T, counting crossings still under way, follows from these
+    _Atomic uint64_t entered[4], entered_us[4];
+    _Atomic uint64_t left[4], left_us[4];
+    _Atomic double clock;              // simulated time of the last crossing
+    _Atomic uint64_t wait[HIST_BUCKETS];  // wait beyond the stop (us), as hist_t
+    struct metrics_block *next;        // metrics_blocks list, never unlinked
+    struct metrics_block *next_spare;  // metrics_spare link
+} metrics_block_t;
+
+// One published snapshot.
+typedef struct {
+    uint64_t published;          // snapshots so far
+    int32_t done;                // the run is over: this is the last one
+    int32_t nisects;
+    double time;                 // simulated seconds
+    double interval;             // wall-clock seconds between snapshots
+    uint64_t exited;             // cars that left an intersection, in total
+    double rate;                 // of those, per simulated second since the
+                                 // previous snapshot
+    int64_t depth[4];            // cars queued on each approach
+    double quad_busy[4];         // share of that time each quadrant was occupied
+    uint64_t window_cars;        // cars that left over the window
+    double wait_p50, wait_p99;   // their wait beyond the stop (seconds)
+} metrics_snap_t;
+
+typedef struct {
+    char magic[4];
+    uint32_t version;
+    _Atomic uint64_t seq;        // odd while snap is being written
+    metrics_snap_t snap;
+} metrics_page_t;
+
+int metrics_on;
+_Thread_local metrics_block_t *my_metrics;
+_Atomic(metrics_block_t *) metrics_blocks;  // every block, newest first
+metrics_block_t *metrics_spare;             // blocks of finished threads
+pthread_mutex_t metrics_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// The calling thread's block: a finished thread's (its counts carry on), or a
+// new one.
+metrics_block_t *metrics_local() {
+    if (my_metrics != NULL) return my_metrics;
+    Pthread_mutex_lock(&metrics_lock);
+    metrics_block_t *b = metrics_spare;
+    if (b != NULL) {
+        metrics_spare = b->next_spare;
+    } else {
+        b = aligned_alloc(64, sizeof(metrics_block_t));
+        assert(b != NULL);
+        memset(b, 0, sizeof(*b));
+        b->next = atomic_load_explicit(&metrics_blocks, memory_order_relaxed);
+        atomic_store_explicit(&metrics_blocks, b, memory_order_release);
+    }
+    Pthread_mutex_unlock(&metrics_lock);
+    my_metrics = b;
+    return b;
+}
+
+// Hand the calling thread's block on to the next thread that starts counting.
+void metrics_thread_done() {
+    if (my_metrics == NULL) return;
+    Pthread_mutex_lock(&metrics_lock);
+    my_metrics->next_spare = metrics_spare;
+    metrics_spare = my_metrics;
+    Pthread_mutex_unlock(&metrics_lock);
+    my_metrics = NULL;
+}
+
+// Add v to a counter of our own block. Only we write it, so this needs no
+// locked instruction; the relaxed atomics just keep the publisher's reads
+// whole.
+void metrics_add(_Atomic uint64_t *a, uint64_t v) {
+    atomic_store_explicit(a, atomic_load_explicit(a, memory_order_relaxed) + v,
+                          memory_order_relaxed);
+}
+
+void metrics_arrived(car_t *c) {
+    metrics_add(&metrics_local()->arrived[dir_index(c->dirs.dir_original)], 1);
+}
+
+void metrics_granted(car_t *c) {
+    metrics_add(&metrics_local()->granted[dir_index(c->dirs.dir_original)], 1);
+}
+
+// c holds its quadrants and starts crossing (at c->t_quads).
+void metrics_crossing(car_t *c) {
+    metrics_block_t *b = metrics_local();
+    int mask = get_move(&c->dirs)->mask;
+    for (int q = 0; q < 4; q++) {
+        if (mask & (1 << q)) {
+            metrics_add(&b->entered[q], 1);
+            metrics_add(&b->entered_us[q], to_us(c->t_quads));
+        }
+    }
+    atomic_store_explicit(&b->clock, c->t_quads, memory_order_relaxed);
+}
+
+// c has left its intersection (at c->t_exit). Its quadrants were freed once
+// the crossing time was up, which in real time can be well before t_exit is
+// stamped if the thread is preempted in between.
+void metrics_exited(car_t *c) {
+    metrics_block_t *b = metrics_local();
+    metrics_add(&b->exited, 1);
+    metrics_add(&b->wait[HistIndex(to_us(c->t_quads - c->t_stop))], 1);
+    double freed = c->t_quads + cfg->cross_time[get_turn(&c->dirs)] + c->cross_drift;
+    int mask = get_move(&c->dirs)->mask;
+    for (int q = 0; q < 4; q++) {
+        if (mask & (1 << q)) {
+            metrics_add(&b->left[q], 1);
+            metrics_add(&b->left_us[q], to_us(freed));
+        }
+    }
+    atomic_store_explicit(&b->clock, c->t_exit, memory_order_relaxed);
+}
+
+// Every block added up.
+typedef struct {
+    uint64_t arrived[4];
+    uint64_t granted[4];
+    uint64_t exited;
+    uint64_t entered[4], entered_us[4];
+    uint64_t left[4], left_us[4];
+    double clock;
+    hist_t wait;
+} metrics_sum_t;
+
+// Microseconds quadrant q was occupied up to time t, over all intersections.
+double metrics_busy(const metrics_sum_t *sum, int q, double t) {
+    int64_t under_way = (int64_t)(sum->entered[q] - sum->left[q]);
+    return (double)(int64_t)(sum->left_us[q] - sum->entered_us[q]) +
+           (double)under_way * (double)to_us(t);
+}
+
+void metrics_collect(metrics_sum_t *sum) {
+    memset(sum, 0, sizeof(*sum));
+    metrics_block_t *b = atomic_load_explicit(&metrics_blocks, memory_order_acquire);
+    for (; b != NULL; b = b->next) {
+        for (int i = 0; i < 4; i++) {
+            sum->arrived[i] += atomic_load_explicit(&b->arrived[i], memory_order_relaxed);
+            sum->granted[i] += atomic_load_explicit(&b->granted[i], memory_order_relaxed);
+            sum->entered[i] += atomic_load_explicit(&b->entered[i], memory_order_relaxed);
+            sum->entered_us[i] += atomic_load_explicit(&b->entered_us[i], memory_order_relaxed);
+            sum->left[i] += atomic_load_explicit(&b->left[i], memory_order_relaxed);
+            sum->left_us[i] += atomic_load_explicit(&b->left_us[i], memory_order_relaxed);
+        }
+        sum->exited += atomic_load_explicit(&b->exited, memory_order_relaxed);
+        double t = atomic_load_explicit(&b->clock, memory_order_relaxed);
+        if (t > sum->clock) sum->clock = t;
+        for (int i = 0; i < HIST_BUCKETS; i++) {
+            uint64_t n = atomic_load_explicit(&b->wait[i], memory_order_relaxed);
+            sum->wait.buckets[i] += n;
+            sum->wait.count += n;
+        }
+    }
+}
+
+void metrics_write(metrics_page_t *pg, const metrics_snap_t *sn) {
+    uint64_t seq = atomic_load_explicit(&pg->seq, memory_order_relaxed);
+    atomic_store_explicit(&pg->seq, seq + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    memcpy(&pg->snap, sn, sizeof(*sn));
+    atomic_store_explicit(&pg->seq, seq + 2, memory_order_release);
+}
+
+// Copy the latest snapshot to out; 0 if none could be read consistently
+// within METRICS_TRIES (a writer that died mid-update never finishes).
+int metrics_read(metrics_page_t *pg, metrics_snap_t *out) {
+    for (int tries = 0; tries < METRICS_TRIES; tries++) {
+        uint64_t seq = atomic_load_explicit(&pg->seq, memory_order_acquire);
+        if (seq & 1) {
+            sched_yield();
+            continue;
+        }
+        metrics_snap_t sn;
+        memcpy(&sn, &pg->snap, sizeof(sn));
+        atomic_thread_fence(memory_order_acquire);
+        if (atomic_load_explicit(&pg->seq, memory_order_relaxed) == seq) {
+            *out = sn;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+struct {
+    metrics_page_t *page;
+    double interval;             // wall-clock seconds
+    int virtual_time;            // the engine's clock is the cars' exits
+    _Atomic uint32_t stop;
+    pthread_t thread;
+} metrics_pub;
+
+void *MetricsPublisher(void *arg) {
+    (void)arg;
+    static metrics_sum_t cur, prev;
+    hist_t *ring = calloc(METRICS_WINDOW, sizeof(hist_t));  // cur.wait at the
+    assert(ring != NULL);                                   // last snapshots
+    double deadline = GetMonoTime(), prev_t = 0;
+
+    for (uint64_t k = 1; ; k++) {
+        deadline += metrics_pub.interval;
+        while (!atomic_load(&metrics_pub.stop) && GetMonoTime() < deadline) {
+            Futex_wait_until(&metrics_pub.stop, 0, deadline);
+        }
+        int last = atomic_load(&metrics_pub.stop);
+
+        metrics_collect(&cur);
+        double t = metrics_pub.virtual_time ? cur.clock : start_ns ? now() : 0;
+        double dt = t - prev_t;
+        metrics_snap_t sn = {
+            .published = k,
+            .done = last,
+            .nisects = grid_nodes(),
+            .time = t,
+            .interval = metrics_pub.interval,
+            .exited = cur.exited,
+            .rate = dt > 0 ? (cur.exited - prev.exited) / dt : 0,
+        };
+        for (int i = 0; i < 4; i++) {
+            sn.depth[i] = (int64_t)(cur.arrived[i] - cur.granted[i]);
+            double busy = metrics_busy(&cur, i, t) - metrics_busy(&prev, i, prev_t);
+            sn.quad_busy[i] = dt > 0 ? busy / 1e6 / (dt * sn.nisects) : 0;
+        }
+
+        // the window is what was added since the snapshot METRICS_WINDOW ago
+        hist_t *old = &ring[k % METRICS_WINDOW];
+        hist_t win;
+        memset(&win, 0, sizeof(win));
+        for (int i = 0; i < HIST_BUCKETS; i++) {
+            win.buckets[i] = cur.wait.buckets[i] - old->buckets[i];
+            win.count += win.buckets[i];
+            if (win.buckets[i] > 0) win.max = HistValue(i);
+        }
+        *old = cur.wait;
+        sn.window_cars = win.count;
+        sn.wait_p50 = HistQuantile(&win, 0.50) / 1e6;
+        sn.wait_p99 = HistQuantile(&win, 0.99) / 1e6;
+
+        metrics_write(metrics_pub.page, &sn);
+        prev = cur;
+        prev_t = t;
+        if (last) break;
+    }
+    free(ring);
+    return NULL;
+}
+
+// Create the page at path and start publishing to it.
+void metrics_start(const char *path, double interval, int virtual_time) {
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0 || ftruncate(fd, sizeof(metrics_page_t)) != 0) {
+        perror(path);
+        exit(1);
+    }
+    metrics_page_t *pg = mmap(NULL, sizeof(metrics_page_t), PROT_READ | PROT_WRITE,
+                              MAP_SHARED, fd, 0);
+    close(fd);
+    if (pg == MAP_FAILED) {
+        perror(path);
+        exit(1);
+    }
+    pg->version = METRICS_VERSION;
+    memcpy(pg->magic, METRICS_MAGIC, 4);
+
+    metrics_pub.page = pg;
+    metrics_pub.interval = interval;
+    metrics_pub.virtual_time = virtual_time;
+    metrics_on = 1;
+    Pthread_create(&metrics_pub.thread, NULL, MetricsPublisher, NULL);
+}
+
+// Publish the final snapshot and stop.
+void metrics_stop() {
+    if (!metrics_on) return;
+    atomic_store(&metrics_pub.stop, 1);
+    Futex_wake_all(&metrics_pub.stop);
+    Pthread_join(metrics_pub.thread, NULL);
+    munmap(metrics_pub.page, sizeof(metrics_page_t));
+    metrics_thread_done();
+}
+
+// --watch: print every snapshot published to path until the run is over.
+int watch_metrics(const char *path) {
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        perror(path);
+        return 1;
+    }
+    metrics_page_t *pg = NULL;
+    if ((size_t)st.st_size >= sizeof(metrics_page_t)) {
+        pg = mmap(NULL, sizeof(metrics_page_t), PROT_READ, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+    if (pg == NULL || pg == MAP_FAILED || memcmp(pg->magic, METRICS_MAGIC, 4) != 0 ||
+        pg->version != METRICS_VERSION) {
+        fprintf(stderr, "%s: not a version %d metrics page\n", path, METRICS_VERSION);
+        return 1;
+    }
+
+    uint64_t seen = 0;
+    double last = GetMonoTime();    // when seen last changed
+    metrics_snap_t sn;
+    memset(&sn, 0, sizeof(sn));
+    for (;;) {
+        int fresh = metrics_read(pg, &sn);
+        double interval = isfinite(sn.interval) && sn.interval > 0 ? sn.interval : 1.0;
+        if (fresh && sn.published != seen) {
+            seen = sn.published;
+            last = GetMonoTime();
+            printf("t=%.1f  %.3f cars/s (%llu out)  queue N %lld E %lld S %lld W %lld  "
+                   "quads %.2f %.2f %.2f %.2f  wait p50 %.3f p99 %.3f (%llu cars)%s\n",
+                   sn.time, sn.rate, (unsigned long long)sn.exited,
+                   (long long)sn.depth[0], (long long)sn.depth[1],
+                   (long long)sn.depth[2], (long long)sn.depth[3],
+                   sn.quad_busy[0], sn.quad_busy[1], sn.quad_busy[2], sn.quad_busy[3],
+                   sn.wait_p50, sn.wait_p99, (unsigned long long)sn.window_cars,
+                   sn.done ? "  done" : "");
+            fflush(stdout);
+            if (sn.done) break;
+        } else if (GetMonoTime() - last > METRICS_STALE * interval) {
+            // the run died without publishing its last snapshot
+            fprintf(stderr, "%s: no snapshot for %.1f s, giving up\n", path,
+                    GetMonoTime() - last);
+            munmap(pg, sizeof(metrics_page_t));
+            return 1;
+        }
+        usleep((useconds_t)(interval * 1e6 / 4));
+    }
+    munmap(pg, sizeof(metrics_page_t));
+    return 0;
+}
+
+// Car actions ------------------------------------------------------------------
+
+void ArriveIntersection(intersection_t *x, car_t *c);
+void CrossIntersection(intersection_t *x, car_t *c);
+void ExitIntersection(intersection_t *x, car_t *c);
+
+// Has the current flow of direction d admitted flow_cap cars while another
+// direction waits? Called with x->turn_lock held.
+int flow_capped(intersection_t *x, int d) {
+    if (cfg->flow_cap == 0 || x->flow_served < cfg->flow_cap) return 0;
+    for (int i = 0; i < 4; i++) {
+        if (i != d && x->dir_waiter[i] != NULL) return 1;
+    }
+    return 0;
+}
+
+// ArriveIntersection at a traffic light: no stop; once head of line, wait
+// for a green (see "Signal control").
+void signal_arrive(intersection_t *x, car_t *c) {
+    int d = dir_index(c->dirs.dir_original);
+    int m = movement_id(&c->dirs);
+
+    STAT_MUTEX_LOCK(&x->turn_lock, &turn_lock_stats);
+    double t = now();
+    signal_advance(&x->signal, t);
+    if (signal_demand(&x->signal, m, 1, t)) {
+        for (int i = 0; i < 4; i++) {
+            pthread_cond_broadcast(&x->dir_cv[i]);  // a red now ends sooner
+        }
+    }
+    Pthread_mutex_unlock(&x->turn_lock);
+    c->t_stop = c->t_arrive;
+
+    STAT_HOL_ACQUIRE(&x->hol[d], &c->hol, d);
+    c->t_hol = now();
+
+    STAT_MUTEX_LOCK(&x->turn_lock, &turn_lock_stats);
+    signal_advance(&x->signal, now());
+    signal_hol(&x->signal, m, c->t_arrive);
+    for (;;) {
+        signal_advance(&x->signal, now());
+        if (signal_green(&x->signal, m)) break;
+        if (x->signal.end == INFINITY) {
+            pthread_cond_wait(&x->dir_cv[d], &x->turn_lock);
+        } else {
+            struct timespec ts = deadline_at(x->signal.end);
+            pthread_cond_timedwait(&x->dir_cv[d], &x->turn_lock, &ts);
+        }
+    }
+    signal_demand(&x->signal, m, -1, 0);
+    atomic_fetch_sub_explicit(&x->queue_depth[d], 1, memory_order_relaxed);
+    c->t_granted = now();
+    Pthread_mutex_unlock(&x->turn_lock);
+}
+
+// ARRIVE: head-of-line + direction/flow logic
+void ArriveIntersection(intersection_t *x, car_t *c) {
+    int d = dir_index(c->dirs.dir_original);
+
+    atomic_fetch_add_explicit(&x->queue_depth[d], 1, memory_order_relaxed);
+    c->t_arrive = log_event(LOG_ARRIVING, c);
+    if (cfg->signal != SIGNAL_OFF) {
+        signal_arrive(x, c);
+        return;
+    }
+
+    // stop at the stop sign
+    sim_sleep(cfg->stop_time);
+    c->t_stop = now();
+
+    // Wait until this car is head-of-line for its direction
+    STAT_HOL_ACQUIRE(&x->hol[d], &c->hol, d);
+    c->t_hol = now();
+
+    // Now coordinate with other directions
+    STAT_MUTEX_LOCK(&x->turn_lock, &turn_lock_stats);
+
+    if (cfg->admission == ADMIT_CONFLICT) {
+        gate_enqueue(&x->gate, c);
+        if (cfg->wakeup_mode == WAKE_TARGETED) {
+            // get in now if we can, else an exiting car admits us (sched_admit)
+            if (gate_admissible(&x->gate, c)) {
+                gate_admit(&x->gate, c);
+                atomic_fetch_sub_explicit(&x->queue_depth[d], 1, memory_order_relaxed);
+            }
+            while (!c->admitted) {
+                pthread_cond_wait(&x->dir_cv[d], &x->turn_lock);
+                STAT_CV_WAKEUP(c->admitted);
+            }
+        } else {
+            // Wait until our movement is compatible with everything admitted
+            while (!gate_admissible(&x->gate, c)) {
+                pthread_cond_wait(&x->turn_cv, &x->turn_lock);
+                STAT_CV_WAKEUP(gate_admissible(&x->gate, c));
+            }
+            gate_admit(&x->gate, c);
+            atomic_fetch_sub_explicit(&x->queue_depth[d], 1, memory_order_relaxed);
+        }
+        c->t_granted = now();
+        Pthread_mutex_unlock(&x->turn_lock);
+        return;
+    }
+
+    // If another direction currently owns the intersection (or ours has used
+    // up its flow cap while someone else waits), wait.
+    while (x->current_direction != -1 &&
+           (x->current_direction != d || flow_capped(x, d))) {
+        if (cfg->wakeup_mode == WAKE_TARGETED) {
+            x->dir_waiter[d] = c;
+            pthread_cond_wait(&x->dir_cv[d], &x->turn_lock);
+            x->dir_waiter[d] = NULL;
+        } else {
+            pthread_cond_wait(&x->turn_cv, &x->turn_lock);
+        }
+        STAT_CV_WAKEUP(x->current_direction == -1 ||
+                       (x->current_direction == d && !flow_capped(x, d)));
+    }
+
+    // At this point either intersection is free (-1) or already serving our
+    // direction (possibly handed to us by the previous flow's last car)
+    if (x->current_direction == -1) {
+        x->current_direction = d;   // take ownership
+        x->flow_count[d] = 1;
+        x->flow_served = 1;
+    } else { // current_direction == d
+        x->flow_count[d]++;         // join existing flow for our direction
+        x->flow_served++;
+    }
+    atomic_fetch_sub_explicit(&x->queue_depth[d], 1, memory_order_relaxed);
+    c->t_granted = now();
+
+    Pthread_mutex_unlock(&x->turn_lock);
+}
+
+// CROSS: lock quadrants, simulate crossing, unlock quadrants
+void CrossIntersection(intersection_t *x, car_t *c) {
+    int q[4];
+    int n = get_quads(c, q);
+    uint32_t m = (uint32_t)get_move(&c->dirs)->mask;
+
+    if (cfg->quad_mode == QUADS_MASK) lock_quad_mask(&x->quad_mask, m);
+    else                         lock_quads(x->quad, q, n, &x->verify, c);
+    VERIFY(verify_enter(&x->verify, c, m, cfg->quad_mode == QUADS_MUTEX));
+
+    // Pipelined flow: our quadrants are held, let the next car move up
+    if (cfg->flow_mode == FLOW_PIPELINED) {
+        hol_release(&x->hol[dir_index(c->dirs.dir_original)], &c->hol);
+    }
+
+    c->t_quads = log_event(LOG_CROSSING, c);
+    if (metrics_on) metrics_crossing(c);
+
+    // Simulate crossing time depending on turn type
+    double secs = cfg->cross_time[get_turn(&c->dirs)];
+    if (cross_mode == CROSS_SLEEP) {
+        // sleep to an absolute deadline instead of burning a core
+        uint64_t begin = GetNanos();
+        SleepUntil((double)begin / 1e9 + secs / time_scale);
+        c->cross_drift = (double)(GetNanos() - begin) / 1e9 * time_scale - secs;
+    } else {
+        Spin(secs / time_scale);
+    }
+
+    VERIFY(verify_leave(&x->verify, c, m));
+    if (cfg->quad_mode == QUADS_MASK) unlock_quad_mask(&x->quad_mask, m);
+    else                         unlock_quads(x->quad, q, n, &x->verify, c);
+}
+
+// EXIT: log exit and update flow control
+void ExitIntersection(intersection_t *x, car_t *c) {
+    int d = dir_index(c->dirs.dir_original);
+
+    c->t_exit = log_event(LOG_EXITING, c);
+    if (latency_on) latency_record_local(c);
+
+    // at a light the phase decides who goes next: nothing to hand over
+    if (cfg->signal == SIGNAL_OFF) {
+        STAT_MUTEX_LOCK(&x->turn_lock, &turn_lock_stats);
+
+        if (cfg->admission == ADMIT_CONFLICT) {
+            gate_release(&x->gate, c);
+            if (cfg->wakeup_mode == WAKE_TARGETED) {
+                // admit on the waiters' behalf and signal only those directions
+                sched_view_t v = {.from = d};
+                sched_gate_heads(&v, &x->gate);
+                for (int i = 0; i < 4; i++) v.depth[i] = atomic_load(&x->queue_depth[i]);
+                car_t *in[4];
+                int n = sched_admit(&x->gate, &v, in);
+                for (int i = 0; i < n; i++) {
+                    int wd = dir_index(in[i]->dirs.dir_original);
+                    atomic_fetch_sub_explicit(&x->queue_depth[wd], 1, memory_order_relaxed);
+                    pthread_cond_signal(&x->dir_cv[wd]);
+                }
+            } else {
+                pthread_cond_broadcast(&x->turn_cv); // waiting movements may be compatible now
+            }
+        } else {
+            x->flow_count[d]--;
+
+            // if no more cars from this direction in intersection,
+            // release ownership and wake the waiting directions
+            if (x->flow_count[d] == 0) {
+                if (cfg->wakeup_mode == WAKE_TARGETED) {
+                    // hand the intersection straight to the scheduler's choice
+                    sched_view_t v = {.from = d};
+                    for (int i = 0; i < 4; i++) {
+                        v.head[i] = x->dir_waiter[i];
+                        v.depth[i] = atomic_load(&x->queue_depth[i]);
+                    }
+                    int next = sched_pick(&v, cfg->flow_cap > 0 && x->flow_served >= cfg->flow_cap);
+                    x->current_direction = next;
+                    if (next != -1) {
+                        x->flow_count[next] = 0;
+                        x->flow_served = 0;
+                        pthread_cond_signal(&x->dir_cv[next]);
+                    }
+                } else {
+                    x->current_direction = -1; // intersection becomes free
+                    pthread_cond_broadcast(&x->turn_cv); // wake all waiting directions
+                }
+            }
+        }
+
+        Pthread_mutex_unlock(&x->turn_lock);
+    }
+
+    // Release head-of-line lock so next car from this direction
+    // can move up to the stop sign (already done at entry when pipelined)
+    if (cfg->flow_mode == FLOW_SERIAL) {
+        hol_release(&x->hol[d], &c->hol);
+    }
+}
+
+// Discrete-event engine ---------------------------------------------------------
+// Replays the same admission rules as the pthread version on a virtual clock:
+// HOL token per direction, current_direction/flow_count, and sorted quadrant
+// locks. Blocking on a primitive becomes parking the car on a FIFO wait list,
+// and releasing the primitive hands it straight to the next parked car, so a
+// whole scenario runs in microseconds instead of waiting out every sleep.
+//
+// Each car is a small state machine driven by these events:
+//   ARRIVED --stop done--> STOPPED --HOL token--> HOL --quadrants--> CROSSING
+//   --exit--> EXITED (record freed)
+
+typedef enum {CAR_ARRIVED, CAR_STOPPED, CAR_HOL, CAR_CROSSING, CAR_EXITED} car_state_t;
+
+typedef enum {EV_ARRIVE, EV_STOP_DONE, EV_ACQUIRE, EV_EXIT, EV_PHASE} ev_type_t;
+
+typedef struct {
+    double time;    // seconds since start
+    long seq;       // breaks ties deterministically (see eq_push)
+    ev_type_t type;
+    int node;       // intersection, for EV_PHASE (which has no car)
+    car_t *car;
+} event_t;
+
+// Binary min-heap of events ordered by (time, seq).
+typedef struct {
+    event_t *heap;
+    int size;
+    int cap;
+    long next_seq;
+} event_queue_t;
+
+int ev_before(const event_t *a, const event_t *b) {
+    if (a->time != b->time) return a->time < b->time;
+    return a->seq < b->seq;
+}
+
+void eq_insert(event_queue_t *eq, event_t e) {
+    if (eq->size == eq->cap) {
+        eq->cap = eq->cap ? eq->cap * 2 : 64;
+        eq->heap = realloc(eq->heap, eq->cap * sizeof(event_t));
+        assert(eq->heap != NULL);
+    }
+    int i = eq->size++;
+    while (i > 0) {
+        int parent = (i - 1) / 2;
+        if (!ev_before(&e, &eq->heap[parent])) break;
+        eq->heap[i] = eq->heap[parent];
+        i = parent;
+    }
+    eq->heap[i] = e;
+}
+
+void eq_push(event_queue_t *eq, double time, ev_type_t type, car_t *c) {
+    // Ties go in insertion order, except on a grid: there they go by car id,
+    // which is a total order (a car has at most one pending event) that does
+    // not depend on how the grid is split between engines.
+    long seq = cfg->grid_on ? c->cid : eq->next_seq++;
+    event_t e = {time, seq, type, c->node, c};
+    eq_insert(eq, e);
+}
+
+// Schedule a phase change at intersection n. Phase changes go before any car
+// event at the same instant, in node order.
+void eq_push_phase(event_queue_t *eq, double time, int n) {
+    event_t e = {time, -1 - (long)n, EV_PHASE, n, NULL};
+    eq_insert(eq, e);
+}
+
+// Remove the earliest event into *out; return 0 when the queue is empty.
+int eq_pop(event_queue_t *eq, event_t *out) {
+    if (eq->size == 0) return 0;
+    *out = eq->heap[0];
+    event_t last = eq->heap[--eq->size];
+    int i = 0;
+    for (;;) {
+        int child = 2 * i + 1;
+        if (child >= eq->size) break;
+        if (child + 1 < eq->size && ev_before(&eq->heap[child + 1], &eq->heap[child]))
+            child++;
+        if (!ev_before(&eq->heap[child], &last)) break;
+        eq->heap[i] = eq->heap[child];
+        i = child;
+    }
+    eq->heap[i] = last;
+    return 1;
+}
+
+// Car sources ----------------------------------------------------------------
+// Engines pull cars one at a time, in arrival order, just ahead of when they
+// are needed, so only cars currently at the intersection are resident.
+
+typedef struct car_source {
+    // Store the next car in *out and return 1, or return 0 when exhausted.
+    int (*next)(struct car_source *src, car_t *out);
+} car_source_t;
+
+// Source over an in-memory array (e.g. the hard-coded cars[]).
+typedef struct {
+    car_source_t base;
+    car_t *cars;
+    int n;
+    int pos;
+} array_source_t;
+
+int array_source_next(car_source_t *src, car_t *out) {
+    array_source_t *a = (array_source_t *)src;
+    if (a->pos >= a->n) return 0;
+    *out = a->cars[a->pos++];
+    return 1;
+}
+
+void array_source_init(array_source_t *a, car_t *list, int n) {
+    a->base.next = array_source_next;
+    a->cars = list;
+    a->n = n;
+    a->pos = 0;
+}
+
+// Car table ------------------------------------------------------------------------
+// The thread engine needs every car for the whole run, so it loads the source
+// into a table, one array per field, rather than an array of car_t:
+// 13 bytes a car (cid, arrival time, directions packed into a byte) plus the
+// grid route and measured metrics only when the run has them. Each car
+// thread expands its row into a car_t on its own stack, and end-of-run
+// reports are sequential passes over one array.
+
+typedef struct {
+    long n;
+    long cap;
+    int *cid;
+    double *arrival;         // arrival_time, in arrival order
+    uint8_t *dirs;           // dir_index(original) << 2 | dir_index(target)
+
+    // grid routes, NULL unless cfg->grid_on
+    int *node;
+    int *dest;
+    uint8_t *final_turn;
+
+    // metrics written back by the run, NULL unless measured
+    double *cross_drift;
+} car_table_t;
+
+// Grow every allocated column of t to hold cap cars.
+void car_table_grow(car_table_t *t, long cap) {
+    t->cap = cap;
+    t->cid = realloc(t->cid, cap * sizeof(int));
+    t->arrival = realloc(t->arrival, cap * sizeof(double));
+    t->dirs = realloc(t->dirs, cap);
+    assert(t->cid != NULL && t->arrival != NULL && t->dirs != NULL);
+    if (cfg->grid_on) {
+        t->node = realloc(t->node, cap * sizeof(int));
+        t->dest = realloc(t->dest, cap * sizeof(int));
+        t->final_turn = realloc(t->final_turn, cap);
+        assert(t->node != NULL && t->dest != NULL && t->final_turn != NULL);
+    }
+}
+
+// Read every car from src.
+void car_table_load(car_table_t *t, car_source_t *src) {
+    memset(t, 0, sizeof(*t));
+    car_t c;
+    while (src->next(src, &c)) {
+        if (t->n == t->cap) car_table_grow(t, t->cap ? t->cap * 2 : 64);
+        long i = t->n++;
+        t->cid[i] = c.cid;
+        t->arrival[i] = c.arrival_time;
+        t->dirs[i] = (uint8_t)(dir_index(c.dirs.dir_original) << 2 |
+                               dir_index(c.dirs.dir_target));
+        if (t->node) {
+            t->node[i] = c.node;
+            t->dest[i] = c.dest;
+            t->final_turn[i] = (uint8_t)c.final_turn;
+        }
+    }
+}
+
+// Expand car i into *c, as the source produced it.
+void car_table_get(const car_table_t *t, long i, car_t *c) {
+    memset(c, 0, sizeof(*c));
+    c->cid = t->cid[i];
+    c->arrival_time = t->arrival[i];
+    c->dirs.dir_original = dir_chars[t->dirs[i] >> 2];
+    c->dirs.dir_target = dir_chars[t->dirs[i] & 3];
+    c->index = (int)i;
+    if (t->node) {
+        c->node = t->node[i];
+        c->dest = t->dest[i];
+        c->final_turn = t->final_turn[i];
+    }
+}
+
+void car_table_free(car_table_t *t) {
+    free(t->cid);
+    free(t->arrival);
+    free(t->dirs);
+    free(t->node);
+    free(t->dest);
+    free(t->final_turn);
+    free(t->cross_drift);
+}
+
+// Workload files ---------------------------------------------------------------
+// Cars can be read from a file (or "-" for stdin) instead of cars[]:
+//
+//   CSV:    one "cid,arrival_time,orig,target" line per car, e.g. "3,3.3,^,<".
+//           Blank lines, '#' comments and a leading "cid,..." header are
+//           skipped. Parsed one line at a time.
+//   binary: wl_header_t followed by wl_record_t records. Regular files are
+//           mmap'ed and read in place; pipes are read in chunks.
+//
+// Either way the whole trace is never resident. Cars must be in
+// non-decreasing arrival order.
+
+#define WL_MAGIC   "\x7fTCW"  // first byte is never valid CSV
+#define WL_VERSION 1
+
+typedef struct {
+    char magic[4];
+    uint32_t version;
+    uint64_t count;           // number of records that follow
+} wl_header_t;
+
+typedef struct {
+    double arrival_time;
+    int32_t cid;
+    char orig;
+    char target;
+    char pad[2];
+} wl_record_t;                // 16 bytes
+
+typedef struct {
+    car_source_t base;
+    FILE *fp;
+    const char *path;
+    int binary;
+    int next_index;           // becomes car_t.index
+
+    // CSV
+    char *line;
+    size_t line_cap;
+    long lineno;
+
+    // binary
+    const wl_record_t *recs;  // mmap'ed records, or NULL when streaming
+    void *map;
+    size_t map_len;
+    uint64_t count;
+    uint64_t pos;
+} file_source_t;
+
+// Fill a car from raw fields, rejecting bad directions.
+int wl_make_car(file_source_t *f, car_t *out, int cid, double t, char o, char d) {
+    if (dir_index(o) < 0 || dir_index(d) < 0) {
+        fprintf(stderr, "%s: car %d has invalid directions '%c' '%c'\n", f->path, cid, o, d);
+        exit(1);
+    }
+    if (!isfinite(t)) {
+        fprintf(stderr, "%s: car %d has arrival time %g\n", f->path, cid, t);
+        exit(1);
+    }
+    memset(out, 0, sizeof(*out));
+    out->cid = cid;
+    out->arrival_time = t;
+    out->dirs.dir_original = o;
+    out->dirs.dir_target = d;
+    out->index = f->next_index++;
+    return 1;
+}
+
+// Next non-blank character at or after p.
+char *skip_space(char *p) {
+    while (*p && isspace((unsigned char)*p)) p++;
+    return p;
+}
+
+int csv_source_next(car_source_t *src, car_t *out) {
+    file_source_t *f = (file_source_t *)src;
+    ssize_t len;
+
+    while ((len = getline(&f->line, &f->line_cap, f->fp)) != -1) {
+        f->lineno++;
+        char *p = skip_space(f->line);
+        if (*p == '\0' || *p == '#') continue;
+        if (f->lineno == 1 && isalpha((unsigned char)*p)) continue; // header
+
+        char *start = p, *end;   // no number parsed leaves end at start
+        long cid = strtol(start, &end, 10);
+        p = skip_space(end);
+        if (end == start || *p != ',') goto bad;
+        start = p + 1;
+        double t = strtod(start, &end);
+        p = skip_space(end);
+        if (end == start || *p != ',') goto bad;
+        p = skip_space(p + 1);
+        char o = *p;
+        p = skip_space(p + 1);
+        if (o == '\0' || *p != ',') goto bad;
+        p = skip_space(p + 1);
+        char d = *p;
+        if (d == '\0' || *skip_space(p + 1) != '\0') goto bad;
+
+        return wl_make_car(f, out, (int)cid, t, o, d);
+    bad:
+        fprintf(stderr, "%s:%ld: expected cid,arrival_time,orig,target\n", f->path, f->lineno);
+        exit(1);
+    }
+    return 0;
+}
+
+int bin_source_next(car_source_t *src, car_t *out) {
+    file_source_t *f = (file_source_t *)src;
+    if (f->pos >= f->count) return 0;
+
+    wl_record_t r;
+    if (f->recs) {
+        r = f->recs[f->pos];
+    } else if (fread(&r, sizeof(r), 1, f->fp) != 1) {
+        fprintf(stderr, "%s: truncated after %llu of %llu records\n",
+                f->path, (unsigned long long)f->pos, (unsigned long long)f->count);
+        exit(1);
+    }
+    f->pos++;
+    return wl_make_car(f, out, r.cid, r.arrival_time, r.orig, r.target);
+}
+
+// Open a workload; the format is detected from the first bytes.
+void file_source_open(file_source_t *f, const char *path) {
+    memset(f, 0, sizeof(*f));
+    f->path = path;
+    f->fp = strcmp(path, "-") == 0 ? stdin : fopen(path, "rb");
+    if (f->fp == NULL) {
+        perror(path);
+        exit(1);
+    }
+
+    int first = getc(f->fp);
+    if (first != WL_MAGIC[0]) {
+        if (first != EOF) ungetc(first, f->fp);
+        f->base.next = csv_source_next;
+        return;
+    }
+
+    wl_header_t h;
+    h.magic[0] = (char)first;
+    if (fread((char *)&h + 1, sizeof(h) - 1, 1, f->fp) != 1 ||
+        memcmp(h.magic, WL_MAGIC, 4) != 0 || h.version != WL_VERSION) {
+        fprintf(stderr, "%s: not a version %d workload file\n", path, WL_VERSION);
+        exit(1);
+    }
+    f->binary = 1;
+    f->count = h.count;
+    f->base.next = bin_source_next;
+
+    // Regular files are mapped read-only and consumed in place.
+    struct stat st;
+    if (f->fp != stdin && fstat(fileno(f->fp), &st) == 0 && S_ISREG(st.st_mode)) {
+        // bound the count by the file before multiplying, so a bad one can't wrap
+        size_t fits = ((size_t)st.st_size - sizeof(h)) / sizeof(wl_record_t);
+        if (h.count > fits) {
+            fprintf(stderr, "%s: truncated (%llu records in the header, room for %zu)\n",
+                    path, (unsigned long long)h.count, fits);
+            exit(1);
+        }
+        size_t need = sizeof(h) + h.count * sizeof(wl_record_t);
+        void *map = mmap(NULL, need, PROT_READ, MAP_PRIVATE, fileno(f->fp), 0);
+        if (map != MAP_FAILED) {
+            madvise(map, need, MADV_SEQUENTIAL);
+            f->map = map;
+            f->map_len = need;
+            f->recs = (const wl_record_t *)((char *)map + sizeof(h));
+        }
+    }
+}
+
+void file_source_close(file_source_t *f) {
+    if (f->map) munmap(f->map, f->map_len);
+    if (f->fp && f->fp != stdin) fclose(f->fp);
+    free(f->line);
+}
+
+// Copy every car from src into a binary workload file; return the car count.
+long write_workload(car_source_t *src, const char *path) {
+    FILE *out = fopen(path, "wb");
+    if (out == NULL) {
+        perror(path);
+        exit(1);
+    }
+
+    wl_header_t h;
+    memcpy(h.magic, WL_MAGIC, 4);
+    h.version = WL_VERSION;
+    h.count = 0;
+    fwrite(&h, sizeof(h), 1, out); // count is patched in at the end
+
+    car_t c;
+    while (src->next(src, &c)) {
+        wl_record_t r;
+        memset(&r, 0, sizeof(r));
+        r.arrival_time = c.arrival_time;
+        r.cid = c.cid;
+        r.orig = c.dirs.dir_original;
+        r.target = c.dirs.dir_target;
+        fwrite(&r, sizeof(r), 1, out);
+        h.count++;
+    }
+
+    fseek(out, 0, SEEK_SET);
+    fwrite(&h, sizeof(h), 1, out);
+    if (fclose(out) != 0) {
+        perror(path);
+        exit(1);
+    }
+    return (long)h.count;
+}
+
+// Traffic generator ------------------------------------------------------------
+// Synthetic cars produced on demand, just ahead of simulated time, so a
+// multi-hour scenario never exists as an array:
+//   - each approach is an independent Poisson process with its own rate
+//   - turns are drawn from a left/straight/right weight mix
+//   - optional platoons: arrivals come in bursts of `platoon` cars spaced
+//     `headway` seconds apart; bursts start at rate/platoon, timed from the
+//     first car of the one before, so the mean car rate per approach is
+//     unchanged (very nearly: a burst that would start before the last one
+//     has finished follows it `headway` behind instead)
+//   - on a grid, "approach d" means every car entering the grid heading d,
+//     at a uniformly chosen edge node, bound for a uniformly chosen node;
+//     the drawn turn is the one it makes there
+// Everything derives from one seed, so a run is reproducible.
+
+typedef struct {
+    car_source_t base;
+    uint64_t rng;            // splitmix64 state
+    double rate[4];          // mean cars/second on each approach
+    double mix[3];           // relative weights of LEFT_T, STRAIGHT_T, RIGHT_T
+    int platoon;             // cars per burst (1 = plain Poisson)
+    double headway;          // seconds between cars within a burst
+    long limit;              // stop after this many cars (0 = no limit)
+    double duration;         // stop after this simulated time (0 = no limit)
+
+    double next_time[4];     // next arrival on each approach
+    int burst_left[4];       // cars still to come in the current burst
+    long emitted;
+} gen_source_t;
+
+uint64_t rng_next(uint64_t *state) {
+    uint64_t z = (*state += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+// Uniform double in [0, 1).
+double rng_uniform(uint64_t *state) {
+    return (double)(rng_next(state) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+// Exponentially distributed gap with the given rate (events/second).
+double rng_exp(uint64_t *state, double rate) {
+    return -log(1.0 - rng_uniform(state)) / rate;
+}
+
+// Schedule the first burst on approach d.
+void gen_first_burst(gen_source_t *g, int d) {
+    g->burst_left[d] = g->platoon - 1;
+    g->next_time[d] = rng_exp(&g->rng, g->rate[d] / g->platoon);
+}
+
+// Schedule the next arrival on approach d after one at time t.
+void gen_advance(gen_source_t *g, int d, double t) {
+    if (g->burst_left[d] > 0) {
+        g->burst_left[d]--;
+        g->next_time[d] = t + g->headway;
+        return;
+    }
+    // t ended a burst; the next one starts a gap after its first car
+    double next = t - (g->platoon - 1) * g->headway + rng_exp(&g->rng, g->rate[d] / g->platoon);
+    if (g->platoon > 1 && next < t + g->headway) next = t + g->headway;
+    g->burst_left[d] = g->platoon - 1;
+    g->next_time[d] = next;
+}
+
+int gen_source_next(car_source_t *src, car_t *out) {
+    gen_source_t *g = (gen_source_t *)src;
+    if (g->limit > 0 && g->emitted >= g->limit) return 0;
+
+    int d = -1;
+    for (int i = 0; i < 4; i++) {
+        if (g->rate[i] > 0 && (d < 0 || g->next_time[i] < g->next_time[d])) d = i;
+    }
+    if (d < 0) return 0;
+    double t = g->next_time[d];
+    if (g->duration > 0 && t > g->duration) return 0;
+
+    // pick the turn, then the target direction that produces it
+    double total = g->mix[0] + g->mix[1] + g->mix[2];
+    double u = rng_uniform(&g->rng) * total;
+    turn_t turn = u < g->mix[0] ? LEFT_T : u < g->mix[0] + g->mix[1] ? STRAIGHT_T : RIGHT_T;
+    int target = turn == LEFT_T ? (d + 3) % 4 : turn == RIGHT_T ? (d + 1) % 4 : d;
+
+    memset(out, 0, sizeof(*out));
+    out->cid = (int)(g->emitted + 1);
+    out->arrival_time = t;
+    out->dirs.dir_original = dir_chars[d];
+    out->dirs.dir_target = dir_chars[target];
+    out->index = (int)g->emitted;
+    if (cfg->grid_on) {
+        // enter on the edge facing heading d, bound for any intersection
+        const grid_t *gr = &cfg->grid;
+        int k = (int)(rng_uniform(&g->rng) * (d == DIR_N || d == DIR_S ? gr->cols : gr->rows));
+        switch (d) {
+            case DIR_N: out->node = (gr->rows - 1) * gr->cols + k; break;
+            case DIR_E: out->node = k * gr->cols; break;
+            case DIR_S: out->node = k; break;
+            case DIR_W: out->node = k * gr->cols + gr->cols - 1; break;
+        }
+        out->dest = (int)(rng_uniform(&g->rng) * grid_nodes());
+        out->final_turn = turn;
+    }
+    g->emitted++;
+
+    gen_advance(g, d, t);
+    return 1;
+}
+
+// Prepare a generator whose parameters (rate, mix, platoon, ...) are set.
+void gen_source_init(gen_source_t *g, uint64_t seed) {
+    g->base.next = gen_source_next;
+    g->rng = seed;
+    g->emitted = 0;
+    if (g->platoon < 1) g->platoon = 1;
+    for (int d = 0; d < 4; d++) {
+        g->burst_left[d] = 0;
+        if (g->rate[d] > 0) gen_first_burst(g, d);
+    }
+}
+
+// Car pools ------------------------------------------------------------------------
+// The event engines need a car_t from the moment a car enters until it
+// leaves. Pools recycle them: records are cut from slabs of CAR_SLAB cars and
+// returned to a free list, so once a run has warmed up, cars entering and
+// leaving cost no allocator calls. A pool has one owner at a time (a thread,
+// or whoever holds the pool engine's lock). Other
+// threads give cars back through its remote list, a lock-free stack that the
+// owner takes over whole with one exchange when its free list runs dry
+// (only the owner pops, so there is no ABA). Slabs go back to the allocator
+// with the pool.
+
+#define CAR_SLAB 256
+
+typedef struct car_slab {
+    struct car_slab *next;
+    car_t cars[CAR_SLAB];
+} car_slab_t;
+
+typedef struct {
+    car_t *free;                 // owner only, linked through car_t.next
+    _Atomic(car_t *) remote;     // given back by other threads
+    car_slab_t *slabs;           // newest first
+    int used;                    // cars cut from slabs->cars so far
+} car_pool_t;
+
+car_t *car_get(car_pool_t *p) {
+    car_t *c = p->free;
+    if (c == NULL) c = atomic_exchange(&p->remote, NULL);
+    if (c != NULL) {
+        p->free = c->next;
+        return c;
+    }
+    if (p->slabs == NULL || p->used == CAR_SLAB) {
+        car_slab_t *s = malloc(sizeof(car_slab_t));
+        assert(s != NULL);
+        s->next = p->slabs;
+        p->slabs = s;
+        p->used = 0;
+    }
+    return &p->slabs->cars[p->used++];
+}
+
+// Give c back, from the owning thread.
+void car_put(car_pool_t *p, car_t *c) {
+    c->next = p->free;
+    p->free = c;
+}
+
+// Give c back, from any other thread.
+void car_put_remote(car_pool_t *p, car_t *c) {
+    car_t *head = atomic_load(&p->remote);
+    do {
+        c->next = head;
+    } while (!atomic_compare_exchange_weak(&p->remote, &head, c));
+}
+
+void car_pool_destroy(car_pool_t *p) {
+    while (p->slabs != NULL) {
+        car_slab_t *next = p->slabs->next;
+        free(p->slabs);
+        p->slabs = next;
+    }
+    p->free = NULL;
+    atomic_store(&p->remote, NULL);
+}
+
+// Simulation state -------------------------------------------------------------
+
+// Event-engine counterpart of intersection_t.
+typedef struct {
+    int hol_free[4];           // hol[d] is free (1 = token available)
+    car_list_t hol_wait[4];    // cars queued in hol_acquire(&hol[d])
+
+    int current_direction;     // same meaning as in intersection_t
+    int flow_count[4];
+    int flow_served;
+    long depth[4];             // queue_depth
+    car_list_t turn_wait;      // cars blocked in pthread_cond_wait(&turn_cv)
+    conflict_gate_t gate;      // used instead under ADMIT_CONFLICT
+
+    car_t *quad_owner[4];      // holder of quad[i], NULL when unlocked
+    car_list_t quad_wait[4];   // cars blocked on quad[i]
+    uint32_t quad_mask;        // occupancy word under QUADS_MASK
+    car_list_t mask_wait;      // cars sleeping on the occupancy word
+    uint32_t occupied;         // verifier's shadow of the crossing cars' quadrants
+
+    signal_t signal;           // under --signal; red cars wait on turn_wait
+    int signal_timer;          // an EV_PHASE is pending
+} sim_node_t;
+
+// Make a zeroed intersection idle.
+void sim_node_init(sim_node_t *x) {
+    x->current_direction = -1;
+    for (int i = 0; i < 4; i++) {
+        x->hol_free[i] = 1;
+    }
+    signal_init(&x->signal);
+}
+
+// Allocate n idle intersections.
+sim_node_t *sim_nodes_new(int n) {
+    sim_node_t *nodes = calloc(n, sizeof(sim_node_t));
+    assert(nodes != NULL);
+    for (int k = 0; k < n; k++) {
+        sim_node_init(&nodes[k]);
+    }
+    return nodes;
+}
+
+// One event engine: a clock and event queue driving a set of intersections.
+typedef struct sim {
+    double clock;              // time of the event being handled
+    event_queue_t events;
+
+    car_source_t *src;         // where the next arrival comes from (or NULL)
+    double last_arrival;       // arrivals must be non-decreasing
+    long active;               // cars in this engine and not yet gone
+
+    sim_node_t *nodes;         // indexed by car_t.node, unless node_at is set
+    sim_node_t **node_at;      // where each node is, when the grid's bands
+                               // keep their own (see grid_split)
+    long departed;             // cars that finished their route here
+    car_pool_t cars;           // this engine's car records
+    car_pool_t *pool;          // where departed cars go (default &cars)
+    int pool_remote;           // pool belongs to another thread
+    // Called for a car moving on to a node another engine owns, NULL when
+    // this engine owns them all (see "Partitioned grid")
+    void (*forward)(struct sim *s, car_t *c);
+    void *owner;               // for forward()
+
+    lat_set_t *lat;            // latency histograms, NULL unless --latency
+
+    // --checkpoint (see "Checkpoints")
+    const char *ckpt_path;
+    double ckpt_at;            // snapshot due once the clock would pass this
+    double ckpt_every;         // seconds from one to the next (0 = only one)
+
+    log_rec_t *logs;           // lines produced by the current event
+    int nlogs;
+    int logs_cap;
+} sim_t;
+
+// Intersection n of s.
+sim_node_t *sim_node(sim_t *s, int n) {
+    return s->node_at != NULL ? s->node_at[n] : &s->nodes[n];
+}
+
+void sim_init(sim_t *s, car_source_t *src, sim_node_t *nodes) {
+    memset(s, 0, sizeof(*s));
+    s->src = src;
+    s->nodes = nodes;
+    s->pool = &s->cars;
+    s->ckpt_at = INFINITY;
+    if (latency_on) {
+        s->lat = calloc(1, sizeof(lat_set_t));
+        assert(s->lat != NULL);
+    }
+}
+
+void sim_destroy(sim_t *s) {
+    car_pool_destroy(&s->cars);
+    free(s->lat);
+    free(s->events.heap);
+    free(s->logs);
+}
+
+// Queue a log line; the engine prints it once it is done with sim state.
+void sim_log(sim_t *s, log_kind_t kind, car_t *c) {
+    if (log_quiet && trace.fp == NULL) return;  // nobody would see it
+    if (s->nlogs == s->logs_cap) {
+        s->logs_cap = s->logs_cap ? s->logs_cap * 2 : 16;
+        s->logs = realloc(s->logs, s->logs_cap * sizeof(log_rec_t));
+        assert(s->logs != NULL);
+    }
+    log_rec_t r = {s->clock, kind, c->cid, c->dirs, c->node};
+    s->logs[s->nlogs++] = r;
+}
+
+// Hand pending log lines to the logger and discard them.
+void sim_flush_logs(sim_t *s) {
+    if (s->nlogs == 0) return;
+    log_submit(s->logs, s->nlogs);
+    s->nlogs = 0;
+}
+
+// Schedule c's arrival at intersection c->node.
+void sim_enter(sim_t *s, car_t *c) {
+    c->next = NULL;
+    s->active++;
+    eq_push(&s->events, c->arrival_time, EV_ARRIVE, c);
+}
+
+// Pull the next car from the source and schedule its arrival.
+void sim_feed(sim_t *s) {
+    car_t next;
+    if (s->src == NULL || !s->src->next(s->src, &next)) return;
+
+    if (next.arrival_time < s->last_arrival) {
+        fprintf(stderr, "car %d arrives at %.3f, before the previous car (%.3f); "
+                "cars must be sorted by arrival time\n",
+                next.cid, next.arrival_time, s->last_arrival);
+        exit(1);
+    }
+    s->last_arrival = next.arrival_time;
+
+    car_t *c = car_get(&s->cars);
+    *c = next;
+    c->quads_held = 0;
+    sim_enter(s, c);
+}
+
+void sim_start(sim_t *s) {
+    sim_feed(s);
+}
+
+// Admitted by the gate: go on to quadrant acquisition.
+void sim_grant(sim_t *s, car_t *c) {
+    sim_node_t *x = sim_node(s, c->node);
+    x->depth[dir_index(c->dirs.dir_original)]--;
+    c->t_granted = s->clock;
+    if (metrics_on) metrics_granted(c);
+    eq_push(&s->events, s->clock, EV_ACQUIRE, c);
+}
+
+// flow_capped() for a simulation.
+int sim_flow_capped(sim_node_t *x, int d) {
+    if (cfg->flow_cap == 0 || x->flow_served < cfg->flow_cap) return 0;
+    for (car_t *w = x->turn_wait.head; w != NULL; w = w->next) {
+        if (dir_index(w->dirs.dir_original) != d) return 1;
+    }
+    return 0;
+}
+
+void sim_try_turn(sim_t *s, car_t *c);
+
+// Wake node n's red cars at its next phase change, unless already due to.
+void sim_signal_timer(sim_t *s, int n) {
+    sim_node_t *x = sim_node(s, n);
+    if (x->signal_timer || x->turn_wait.head == NULL) return;
+    x->signal_timer = 1;
+    eq_push_phase(&s->events, x->signal.end, n);
+}
+
+// EV_PHASE: the light at node n changed; let its green cars go.
+void sim_phase(sim_t *s, int n) {
+    sim_node_t *x = sim_node(s, n);
+    x->signal_timer = 0;
+    car_list_t waiting = x->turn_wait;
+    x->turn_wait.head = x->turn_wait.tail = NULL;
+    car_t *w;
+    while ((w = cl_pop(&waiting)) != NULL) {
+        sim_try_turn(s, w);      // parks the red ones again, in order
+    }
+}
+
+// Direction check from ArriveIntersection: either join/take the flow and move
+// on to quadrant acquisition, or park until the owning flow drains.
+void sim_try_turn(sim_t *s, car_t *c) {
+    sim_node_t *x = sim_node(s, c->node);
+    int d = dir_index(c->dirs.dir_original);
+
+    if (cfg->signal != SIGNAL_OFF) {
+        int m = movement_id(&c->dirs);
+        signal_advance(&x->signal, s->clock);
+        signal_hol(&x->signal, m, c->t_arrive);
+        if (signal_green(&x->signal, m)) {
+            signal_demand(&x->signal, m, -1, s->clock);
+            sim_grant(s, c);
+        } else {
+            cl_push(&x->turn_wait, c);
+            sim_signal_timer(s, c->node);
+        }
+        return;
+    }
+
+    if (cfg->admission == ADMIT_CONFLICT) {
+        gate_enqueue(&x->gate, c);
+        if (gate_admissible(&x->gate, c)) {
+            gate_admit(&x->gate, c);
+            sim_grant(s, c);
+        }
+        return;
+    }
+    if (x->current_direction != -1 &&
+        (x->current_direction != d || sim_flow_capped(x, d))) {
+        cl_push(&x->turn_wait, c);
+        return;
+    }
+    if (x->current_direction == -1) {
+        x->current_direction = d;
+        x->flow_count[d] = 1;
+        x->flow_served = 1;
+    } else {
+        x->flow_count[d]++;
+        x->flow_served++;
+    }
+    sim_grant(s, c);
+}
+
+// Direction d's flow has drained: pass the intersection on.
+void sim_handover(sim_t *s, sim_node_t *x, int d) {
+    car_list_t waiting = x->turn_wait;
+    x->turn_wait.head = x->turn_wait.tail = NULL;
+    car_t *w;
+
+    if (cfg->wakeup_mode == WAKE_BROADCAST) {
+        // every parked car re-checks, in the order it parked
+        x->current_direction = -1;
+        while ((w = cl_pop(&waiting)) != NULL) {
+            sim_try_turn(s, w);
+        }
+        return;
+    }
+
+    // targeted: grant the scheduler's choice and wake only its car; the rest
+    // stay parked in their original order
+    sched_view_t v = {.from = d};
+    for (w = waiting.head; w != NULL; w = w->next) {
+        v.head[dir_index(w->dirs.dir_original)] = w;
+    }
+    memcpy(v.depth, x->depth, sizeof(v.depth));
+    int capped = cfg->flow_cap > 0 && x->flow_served >= cfg->flow_cap;
+    int next = sched_pick(&v, capped);
+    x->current_direction = next;
+    if (next != -1) {
+        x->flow_count[next] = 0;
+        x->flow_served = 0;
+    }
+    while ((w = cl_pop(&waiting)) != NULL) {
+        if (dir_index(w->dirs.dir_original) == next) sim_try_turn(s, w);
+        else cl_push(&x->turn_wait, w);
+    }
+}
+
+// The car now holds its direction's HOL token.
+void sim_take_hol(sim_t *s, car_t *c) {
+    c->state = CAR_HOL;
+    c->t_hol = s->clock;
+    sim_try_turn(s, c);
+}
+
+// hol_release(&hol[d]): hand the token to the next car, if any.
+void sim_hol_post(sim_t *s, sim_node_t *x, int d) {
+    car_t *next = cl_pop(&x->hol_wait[d]);
+    if (next) sim_take_hol(s, next);
+    else      x->hol_free[d] = 1;
+}
+
+// The car now holds every quadrant it needs: start crossing.
+void sim_start_crossing(sim_t *s, car_t *c) {
+#ifndef TC_NO_VERIFY
+    sim_node_t *x = sim_node(s, c->node);
+    uint32_t m = (uint32_t)get_move(&c->dirs)->mask;
+    if (x->occupied & m) {
+        car_t *o = NULL;
+        for (int i = 0; i < 4; i++) {
+            if (x->occupied & m & (1u << i)) o = x->quad_owner[i];
+        }
+        verify_fail("crossing cars overlap", c, o, x->occupied & m);
+    }
+    if (c->quads_held != c->nq) verify_fail("crossing without its quadrants", c, NULL, m);
+    x->occupied |= m;
+#endif
+    c->state = CAR_CROSSING;
+    c->t_quads = s->clock;
+    if (metrics_on) metrics_crossing(c);
+    if (cfg->flow_mode == FLOW_PIPELINED) {
+        sim_hol_post(s, sim_node(s, c->node), dir_index(c->dirs.dir_original));
+    }
+    sim_log(s, LOG_CROSSING, c);
+    eq_push(&s->events, s->clock + cfg->cross_time[get_turn(&c->dirs)], EV_EXIT, c);
+}
+
+// Claim all of c's quadrants at once, or park until they are all free.
+int sim_try_quad_mask(sim_t *s, car_t *c) {
+    sim_node_t *x = sim_node(s, c->node);
+    uint32_t m = (uint32_t)get_move(&c->dirs)->mask;
+    if (x->quad_mask & m) return 0;
+    x->quad_mask |= m;
+    c->quads_held = c->nq;
+    return 1;
+}
+
+// Lock order and wait-for checks of verify_lock, for a simulation: cars hold
+// a prefix of their q[], and one that has not started crossing is waiting
+// for the next entry.
+void sim_verify_lock(sim_node_t *x, car_t *c, int q) {
+    if (c->quads_held > 0 && c->q[c->quads_held - 1] >= q) {
+        verify_fail("quadrant locked out of order", c, NULL, 1u << q);
+    }
+    car_t *o = x->quad_owner[q];
+    for (int hops = 0; o != NULL && o->state != CAR_CROSSING && hops < 4; hops++) {
+        car_t *next = x->quad_owner[o->q[o->quads_held]];
+        if (next == c) verify_fail("wait-for cycle", c, o, 1u << q);
+        o = next;
+    }
+}
+
+// Take c's remaining quadrants in sorted order, parking on the first busy one
+// (a car keeps what it already holds, exactly like lock_quads).
+void sim_lock_quads(sim_t *s, car_t *c) {
+    sim_node_t *x = sim_node(s, c->node);
+    if (cfg->quad_mode == QUADS_MASK) {
+        if (sim_try_quad_mask(s, c)) sim_start_crossing(s, c);
+        else                         cl_push(&x->mask_wait, c);
+        return;
+    }
+
+    while (c->quads_held < c->nq) {
+        int q = c->q[c->quads_held];
+        VERIFY(sim_verify_lock(x, c, q));
+        if (x->quad_owner[q] != NULL) {
+            cl_push(&x->quad_wait[q], c);
+            return;
+        }
+        x->quad_owner[q] = c;
+        c->quads_held++;
+    }
+    sim_start_crossing(s, c);
+}
+
+// Release quadrants in reverse order, handing each to its next waiter.
+void sim_unlock_quads(sim_t *s, car_t *c) {
+    sim_node_t *x = sim_node(s, c->node);
+#ifndef TC_NO_VERIFY
+    uint32_t m = (uint32_t)get_move(&c->dirs)->mask;
+    if ((x->occupied & m) != m) {
+        verify_fail("quadrants left that were not occupied", c, NULL, m & ~x->occupied);
+    }
+    x->occupied &= ~m;
+#endif
+    if (cfg->quad_mode == QUADS_MASK) {
+        // clear our bits, then let every sleeper retry in the order it parked
+        x->quad_mask &= ~(uint32_t)get_move(&c->dirs)->mask;
+        c->quads_held = 0;
+        car_list_t waiting = x->mask_wait;
+        x->mask_wait.head = x->mask_wait.tail = NULL;
+        car_t *w;
+        while ((w = cl_pop(&waiting)) != NULL) {
+            if (sim_try_quad_mask(s, w)) sim_start_crossing(s, w);
+            else                         cl_push(&x->mask_wait, w);
+        }
+        return;
+    }
+
+    for (int i = c->nq - 1; i >= 0; i--) {
+        int q = c->q[i];
+        car_t *w = cl_pop(&x->quad_wait[q]);
+        x->quad_owner[q] = w;
+        if (w) {
+            w->quads_held++;
+            sim_lock_quads(s, w);
+        }
+    }
+    c->quads_held = 0;
+}
+
+void sim_handle(sim_t *s, event_t *e) {
+    if (e->type == EV_PHASE) {
+        sim_phase(s, e->node);
+        return;
+    }
+    car_t *c = e->car;
+    sim_node_t *x = sim_node(s, c->node);
+    int d = dir_index(c->dirs.dir_original);
+
+    switch (e->type) {
+    case EV_ARRIVE:
+        if (cfg->grid_on) grid_route(c);
+        c->state = CAR_ARRIVED;
+        c->t_arrive = s->clock;
+        x->depth[d]++;
+        if (metrics_on) metrics_arrived(c);
+        sim_log(s, LOG_ARRIVING, c);
+        if (cfg->signal != SIGNAL_OFF) {
+            // no stop at a light
+            signal_advance(&x->signal, s->clock);
+            signal_demand(&x->signal, movement_id(&c->dirs), 1, s->clock);
+            eq_push(&s->events, s->clock, EV_STOP_DONE, c);
+        } else {
+            eq_push(&s->events, s->clock + cfg->stop_time, EV_STOP_DONE, c);
+        }
+        sim_feed(s);
+        break;
+
+    case EV_STOP_DONE:
+        // hol_acquire(&hol[d])
+        c->state = CAR_STOPPED;
+        c->t_stop = s->clock;
+        if (x->hol_free[d]) {
+            x->hol_free[d] = 0;
+            sim_take_hol(s, c);
+        } else {
+            cl_push(&x->hol_wait[d], c);
+        }
+        break;
+
+    case EV_PHASE:   // handled above: it has no car
+        break;
+
+    case EV_ACQUIRE:
+        c->nq = get_quads(c, c->q);
+        c->quads_held = 0;
+        sim_lock_quads(s, c);
+        break;
+
+    case EV_EXIT: {
+        sim_unlock_quads(s, c);
+        c->state = CAR_EXITED;
+        c->t_exit = s->clock;
+        sim_log(s, LOG_EXITING, c);
+        if (s->lat) latency_record(s->lat, c);
+        if (metrics_on) metrics_exited(c);
+
+        if (cfg->signal != SIGNAL_OFF) {
+            // the light admits cars on its own schedule
+        } else if (cfg->admission == ADMIT_CONFLICT) {
+            gate_release(&x->gate, c);
+            if (cfg->wakeup_mode == WAKE_TARGETED) {
+                sched_view_t v = {.from = d};
+                sched_gate_heads(&v, &x->gate);
+                memcpy(v.depth, x->depth, sizeof(v.depth));
+                car_t *in[4];
+                int n = sched_admit(&x->gate, &v, in);
+                for (int i = 0; i < n; i++) {
+                    sim_grant(s, in[i]);
+                }
+            } else {
+                // re-check every waiting car, oldest first
+                car_t *w = x->gate.waiting.head;
+                while (w != NULL) {
+                    car_t *after = w->next;
+                    if (gate_admissible(&x->gate, w)) {
+                        gate_admit(&x->gate, w);
+                        sim_grant(s, w);
+                    }
+                    w = after;
+                }
+            }
+        } else if (--x->flow_count[d] == 0) {
+            sim_handover(s, x, d);
+        }
+
+        if (cfg->flow_mode == FLOW_SERIAL) {
+            sim_hol_post(s, x, d);
+        }
+
+        // on to the next intersection of its route, or gone
+        s->active--;
+        if (cfg->grid_on && grid_advance(c, s->clock + cfg->grid.link_time)) {
+            if (s->forward) s->forward(s, c);
+            else            sim_enter(s, c);
+        } else {
+            s->departed++;
+            if (s->pool_remote) car_put_remote(s->pool, c);
+            else                car_put(s->pool, c);
+        }
+        break;
+    }
+    }
+}
+
+// --checkpoint and --restore (see "Checkpoints")
+typedef struct snapshot snapshot_t;
+const snapshot_t *restore_from;   // state to start from, NULL for t = 0
+const char *checkpoint_path;      // where to write snapshots, NULL for none
+double checkpoint_at, checkpoint_every;
+void snap_save(sim_t *s);
+void snap_restore(sim_t *s, const snapshot_t *snap);
+
+// Handle events until there are none left.
+void sim_drain(sim_t *s) {
+    event_t e;
+    while (s->events.size > 0) {
+        if (s->events.heap[0].time > s->ckpt_at) snap_save(s);
+        eq_pop(&s->events, &e);
+        s->clock = e.time;
+        sim_handle(s, &e);
+        sim_flush_logs(s);
+    }
+    if (s->active != 0) {
+        // every parked car waits for something no pending event will free
+        fprintf(stderr, "safety violation: deadlock: %ld cars still waiting with no "
+                "event left to wake them\n", s->active);
+        abort();
+    }
+}
+
+// Run all cars to completion on the virtual clock.
+void sim_run(car_source_t *src) {
+    sim_t s;
+    sim_init(&s, src, sim_nodes_new(grid_nodes()));
+    if (restore_from) snap_restore(&s, restore_from);
+    else              sim_start(&s);
+    if (checkpoint_path) {
+        s.ckpt_path = checkpoint_path;
+        s.ckpt_at = checkpoint_at;
+        s.ckpt_every = checkpoint_every;
+    }
+
+    log_start(1);
+    sim_drain(&s);
+    log_stop();
+    if (s.lat) latency_report(s.lat);
+
+    free(s.nodes);
+    sim_destroy(&s);
+}
+
+// What sweeps and benchmarks keep of a run.
+typedef struct {
+    long cars;                 // cars that completed their route
+    double makespan;           // time of the last event (seconds; since the
+                               // snapshot for a restored run)
+    hist_t wait;               // wait beyond the stop per intersection passed (us)
+} sim_summary_t;
+
+// Run src to completion under cfg, printing nothing, and summarize it. A run
+// restored from a snapshot is a what-if branch and is summarized from there.
+void sim_summarize(car_source_t *src, sim_summary_t *out) {
+    sim_t s;
+    sim_init(&s, src, sim_nodes_new(grid_nodes()));
+    if (s.lat == NULL) {
+        s.lat = calloc(1, sizeof(lat_set_t));
+        assert(s.lat != NULL);
+    }
+    if (restore_from) {
+        snap_restore(&s, restore_from);
+        memset(s.lat, 0, sizeof(lat_set_t));
+    } else {
+        sim_start(&s);
+    }
+    long departed = s.departed;
+    double begin = s.clock;
+    sim_drain(&s);
+
+    memset(&out->wait, 0, sizeof(out->wait));
+    for (int d = 0; d < 4; d++) HistMerge(&out->wait, &s.lat->by_dir[d]);
+    out->cars = s.departed - departed;
+    out->makespan = s.clock - begin;
+
+    free(s.nodes);
+    sim_destroy(&s);
+}
+
+// Checkpoints ----------------------------------------------------------------------
+// --checkpoint=FILE@T[,P] snapshots an event-engine run once its clock
+// reaches T seconds (and every P seconds after that); --restore=FILE carries
+// on from a snapshot instead of from t = 0. A snapshot is laid out as
+//
+//   snap_header_t   clock, counters, the run options, and how far the car
+//                   source had got (for the generator: its RNG state and
+//                   next arrival on each approach)
+//   sim_node_t[]    every intersection: HOL tokens, flows, gate, quadrants,
+//                   signal
+//   car_t[]         every car in flight
+//   event_t[]       the pending events, in heap order
+//   lat_set_t       the latency histograms, if the run had --latency
+//
+// The records are the engine's own structs with every car pointer replaced
+// by that car's index in car_t[] plus one, so restoring maps the file and
+// copies the records into place: there is nothing to parse. Snapshots are
+// written next to FILE and renamed over it, so a crash mid-write leaves the
+// previous one intact. They are only read back by the same build (the
+// header records the record sizes).
+//
+// The options that shape the state (grid, flow, admission, quads, whether
+// there are signals and how many phases) must match the snapshot's. All the
+// others may differ, which makes the restored run a what-if branch of the
+// original; with --sweep every point of the sweep restores the same mapping.
+
+#define SNAP_MAGIC   "\x7fTCS"
+#define SNAP_VERSION 1
+
+// Where the cars came from
+enum {SNAP_SRC_ARRAY, SNAP_SRC_FILE, SNAP_SRC_GEN};
+
+typedef struct {
+    char magic[4];
+    uint32_t version;
+    uint32_t node_size, car_size, event_size, lat_size;
+    int32_t nnodes;
+    int32_t has_lat;
+    int64_t ncars;
+    int64_t nevents;
+
+    run_config_t config;      // options the state was built under
+    double at;                // time it was taken for (--checkpoint's T)
+    double clock;
+    double last_arrival;
+    int64_t active;
+    int64_t departed;
+    int64_t next_seq;
+
+    int32_t source;           // SNAP_SRC_*
+    int64_t fed;              // cars taken from the source so far
+    uint64_t rng;             // generator state, for SNAP_SRC_GEN
+    double next_time[4];
+    int32_t burst_left[4];
+} snap_header_t;
+
+// A mapped snapshot file.
+struct snapshot {
+    const char *path;
+    void *map;
+    size_t len;
+    const snap_header_t *h;
+    const sim_node_t *nodes;
+    const car_t *cars;
+    const event_t *events;
+    const lat_set_t *lat;     // NULL if taken without --latency
+};
+
+// Cars in flight: sorted by address while saving (a car's position is its
+// record), in record order while restoring.
+typedef struct {
+    car_t **cars;
+    long n;
+    long cap;
+    const char *path;
+} snap_cars_t;
+
+// Apply f to every car pointer in x: the lists of parked cars (which go on
+// through car_t.next) and the quadrant owners.
+void snap_node_refs(sim_node_t *x, car_t *(*f)(void *arg, car_t *c), void *arg) {
+    car_list_t *lists[11];
+    int n = 0;
+    for (int i = 0; i < 4; i++) lists[n++] = &x->hol_wait[i];
+    for (int i = 0; i < 4; i++) lists[n++] = &x->quad_wait[i];
+    lists[n++] = &x->turn_wait;
+    lists[n++] = &x->gate.waiting;
+    lists[n++] = &x->mask_wait;
+    for (int i = 0; i < n; i++) {
+        lists[i]->head = f(arg, lists[i]->head);
+        lists[i]->tail = f(arg, lists[i]->tail);
+    }
+    for (int i = 0; i < 4; i++) {
+        x->quad_owner[i] = f(arg, x->quad_owner[i]);
+    }
+}
+
+// f for snap_node_refs: note c and every car parked behind it.
+car_t *snap_collect(void *arg, car_t *c) {
+    snap_cars_t *live = arg;
+    for (car_t *w = c; w != NULL; w = w->next) {
+        if (live->n == live->cap) {
+            live->cap = live->cap ? live->cap * 2 : 256;
+            live->cars = realloc(live->cars, live->cap * sizeof(car_t *));
+            assert(live->cars != NULL);
+        }
+        live->cars[live->n++] = w;
+    }
+    return c;
+}
+
+int snap_car_cmp(const void *a, const void *b) {
+    uintptr_t x = (uintptr_t)*(car_t *const *)a, y = (uintptr_t)*(car_t *const *)b;
+    return x < y ? -1 : x > y;
+}
+
+// f for snap_node_refs when saving: pointer to record index + 1.
+car_t *snap_ref(void *arg, car_t *c) {
+    if (c == NULL) return NULL;
+    snap_cars_t *live = arg;
+    car_t **at = bsearch(&c, live->cars, live->n, sizeof(car_t *), snap_car_cmp);
+    assert(at != NULL);
+    return (car_t *)(uintptr_t)(at - live->cars + 1);
+}
+
+// ...and back when restoring.
+car_t *snap_deref(void *arg, car_t *ref) {
+    if (ref == NULL) return NULL;
+    snap_cars_t *t = arg;
+    uintptr_t i = (uintptr_t)ref;
+    if (i > (uintptr_t)t->n) {
+        fprintf(stderr, "%s: corrupt snapshot (car record %lu of %ld)\n",
+                t->path, (unsigned long)i, t->n);
+        exit(1);
+    }
+    return t->cars[i - 1];
+}
+
+// Exit if a restored car, intersection or event holds a field that is used
+// as an index but is out of range; snap_deref covers the car references.
+void snap_check_car(const snap_cars_t *t, long i, int nnodes) {
+    const car_t *c = t->cars[i];
+    int ok = c->node >= 0 && c->node < nnodes && c->dest >= 0 && c->dest < nnodes &&
+             dir_index(c->dirs.dir_original) >= 0 && dir_index(c->dirs.dir_target) >= 0 &&
+             c->final_turn >= LEFT_T && c->final_turn <= RIGHT_T &&
+             c->state >= CAR_ARRIVED && c->state <= CAR_EXITED &&
+             c->nq >= 0 && c->nq <= 3 && c->quads_held >= 0 && c->quads_held <= c->nq;
+    for (int k = 0; ok && k < c->nq; k++) ok = c->q[k] >= 0 && c->q[k] < 4;
+    if (!ok) {
+        fprintf(stderr, "%s: corrupt snapshot (car record %ld of %ld)\n",
+                t->path, i + 1, t->n);
+        exit(1);
+    }
+}
+
+void snap_check_node(const snap_cars_t *t, const sim_node_t *x, int k) {
+    int ok = x->current_direction >= -1 && x->current_direction < 4 &&
+             (cfg->signal == SIGNAL_OFF ||
+              (x->signal.phase >= 0 && x->signal.phase < cfg->nphases));
+    for (int d = 0; ok && d < 4; d++) {
+        ok = (x->hol_free[d] == 0 || x->hol_free[d] == 1) && x->flow_count[d] >= 0 &&
+             x->signal.hol_move[d] >= -1 && x->signal.hol_move[d] < NUM_MOVES;
+    }
+    for (int m = 0; ok && m < NUM_MOVES; m++) ok = x->gate.active[m] >= 0;
+    if (!ok) {
+        fprintf(stderr, "%s: corrupt snapshot (intersection %d)\n", t->path, k);
+        exit(1);
+    }
+}
+
+void snap_check_event(const snap_cars_t *t, const event_t *e, int i, int nnodes) {
+    int ok = e->type >= EV_ARRIVE && e->type <= EV_PHASE &&
+             (e->type == EV_PHASE ? e->node >= 0 && e->node < nnodes : e->car != NULL);
+    if (!ok) {
+        fprintf(stderr, "%s: corrupt snapshot (event %d)\n", t->path, i);
+        exit(1);
+    }
+}
+
+int snap_source_kind(car_source_t *src) {
+    if (src->next == gen_source_next) return SNAP_SRC_GEN;
+    if (src->next == array_source_next) return SNAP_SRC_ARRAY;
+    return SNAP_SRC_FILE;
+}
+
+// Record how far src has got.
+void snap_source_save(car_source_t *src, snap_header_t *h) {
+    h->source = snap_source_kind(src);
+    if (h->source == SNAP_SRC_GEN) {
+        gen_source_t *g = (gen_source_t *)src;
+        h->fed = g->emitted;
+        h->rng = g->rng;
+        memcpy(h->next_time, g->next_time, sizeof(h->next_time));
+        memcpy(h->burst_left, g->burst_left, sizeof(h->burst_left));
+    } else if (h->source == SNAP_SRC_ARRAY) {
+        h->fed = ((array_source_t *)src)->pos;
+    } else {
+        h->fed = ((file_source_t *)src)->next_index;
+    }
+}
+
+// Bring a freshly opened src to where the snapshot's source was. The
+// generator takes its parameters from the command line and its state from the
+// snapshot; workloads are skipped forward (mapped ones by setting the index).
+void snap_source_restore(car_source_t *src, const snapshot_t *sn) {
+    static const char *names[] = {"the built-in cars", "--input", "--generate"};
+    const snap_header_t *h = sn->h;
+    int kind = snap_source_kind(src);
+    if (kind != h->source) {
+        fprintf(stderr, "%s: snapshot was taken with %s, not %s\n",
+                sn->path, names[h->source], names[kind]);
+        exit(1);
+    }
+
+    if (kind == SNAP_SRC_GEN) {
+        gen_source_t *g = (gen_source_t *)src;
+        g->emitted = h->fed;
+        g->rng = h->rng;
+        memcpy(g->next_time, h->next_time, sizeof(g->next_time));
+        memcpy(g->burst_left, h->burst_left, sizeof(g->burst_left));
+        return;
+    }
+    file_source_t *f = (file_source_t *)src;
+    if (kind == SNAP_SRC_FILE && f->recs != NULL && (uint64_t)h->fed <= f->count) {
+        f->pos = h->fed;
+        f->next_index = (int)h->fed;
+        return;
+    }
+    car_t c;
+    for (int64_t i = 0; i < h->fed; i++) {
+        if (!src->next(src, &c)) {
+            fprintf(stderr, "%s: snapshot is %lld cars into its input, which has only "
+                    "%lld\n", sn->path, (long long)h->fed, (long long)i);
+            exit(1);
+        }
+    }
+}
+
+// Refuse a snapshot whose state the current options could not carry on.
+void snap_check_config(const snapshot_t *sn) {
+    const run_config_t *was = &sn->h->config;
+    const char *what = NULL;
+    if (was->grid_on != cfg->grid_on || was->grid.rows != cfg->grid.rows ||
+        was->grid.cols != cfg->grid.cols) what = "--grid";
+    else if (was->flow_mode != cfg->flow_mode) what = "--flow";
+    else if (was->admission != cfg->admission) what = "--admission";
+    else if (was->quad_mode != cfg->quad_mode) what = "--quads";
+    else if ((was->signal == SIGNAL_OFF) != (cfg->signal == SIGNAL_OFF)) what = "--signal";
+    else if (cfg->signal != SIGNAL_OFF && was->nphases != cfg->nphases) what = "--phases";
+    if (what != NULL) {
+        fprintf(stderr, "%s: snapshot was taken with a different %s\n", sn->path, what);
+        exit(1);
+    }
+    if (sn->h->nnodes != grid_nodes()) {
+        fprintf(stderr, "%s: snapshot has %d intersections, this run %d\n", sn->path,
+                (int)sn->h->nnodes, grid_nodes());
+        exit(1);
+    }
+}
+
+// Write s's state to s->ckpt_path and schedule the next snapshot.
+void snap_save(sim_t *s) {
+    // number the cars in flight: each has a pending event or is parked
+    snap_cars_t live = {0};
+    int nnodes = grid_nodes();
+    for (int i = 0; i < s->events.size; i++) {
+        snap_collect(&live, s->events.heap[i].car);
+    }
+    for (int k = 0; k < nnodes; k++) {
+        snap_node_refs(&s->nodes[k], snap_collect, &live);
+    }
+    qsort(live.cars, live.n, sizeof(car_t *), snap_car_cmp);
+    long n = 0;
+    for (long i = 0; i < live.n; i++) {
+        if (n == 0 || live.cars[i] != live.cars[n - 1]) live.cars[n++] = live.cars[i];
+    }
+    live.n = n;
+    assert(n == s->active);
+
+    char *tmp = malloc(strlen(s->ckpt_path) + 5);
+    assert(tmp != NULL);
+    sprintf(tmp, "%s.tmp", s->ckpt_path);
+    FILE *out = fopen(tmp, "wb");
+    if (out == NULL) {
+        perror(tmp);
+        exit(1);
+    }
+
+    snap_header_t h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, SNAP_MAGIC, 4);
+    h.version = SNAP_VERSION;
+    h.node_size = sizeof(sim_node_t);
+    h.car_size = sizeof(car_t);
+    h.event_size = sizeof(event_t);
+    h.lat_size = sizeof(lat_set_t);
+    h.nnodes = nnodes;
+    h.has_lat = s->lat != NULL;
+    h.ncars = n;
+    h.nevents = s->events.size;
+    h.config = *cfg;
+    h.at = s->ckpt_at;
+    h.clock = s->clock;
+    h.last_arrival = s->last_arrival;
+    h.active = s->active;
+    h.departed = s->departed;
+    h.next_seq = s->events.next_seq;
+    snap_source_save(s->src, &h);
+    fwrite(&h, sizeof(h), 1, out);
+
+    for (int k = 0; k < nnodes; k++) {
+        sim_node_t x = s->nodes[k];
+        snap_node_refs(&x, snap_ref, &live);
+        fwrite(&x, sizeof(x), 1, out);
+    }
+    for (long i = 0; i < n; i++) {
+        car_t c = *live.cars[i];
+        c.next = snap_ref(&live, c.next);
+        memset(&c.hol, 0, sizeof(c.hol));   // pthread version only
+        fwrite(&c, sizeof(c), 1, out);
+    }
+    for (int i = 0; i < s->events.size; i++) {
+        event_t e = s->events.heap[i];
+        e.car = snap_ref(&live, e.car);
+        fwrite(&e, sizeof(e), 1, out);
+    }
+    if (s->lat) fwrite(s->lat, sizeof(lat_set_t), 1, out);
+
+    int failed = ferror(out);
+    if (fclose(out) != 0) failed = 1;
+    if (failed || rename(tmp, s->ckpt_path) != 0) {
+        perror(s->ckpt_path);
+        exit(1);
+    }
+    fprintf(stderr, "checkpoint: t=%.3f, %ld cars in flight, %d events -> %s\n",
+            s->ckpt_at, n, s->events.size, s->ckpt_path);
+    free(tmp);
+    free(live.cars);
+
+    if (s->ckpt_every > 0) {
+        while (s->ckpt_at < s->events.heap[0].time) s->ckpt_at += s->ckpt_every;
+    } else {
+        s->ckpt_at = INFINITY;
+    }
+}
+
+// Map a snapshot file and check it; exits if it is unusable.
+snapshot_t *snap_open(const char *path) {
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        perror(path);
+        exit(1);
+    }
+    size_t len = (size_t)st.st_size;
+    if (len < sizeof(snap_header_t)) {
+        fprintf(stderr, "%s: not a snapshot\n", path);
+        exit(1);
+    }
+    void *map = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        perror(path);
+        exit(1);
+    }
+
+    const snap_header_t *h = map;
+    if (memcmp(h->magic, SNAP_MAGIC, 4) != 0 || h->version != SNAP_VERSION ||
+        h->node_size != sizeof(sim_node_t) || h->car_size != sizeof(car_t) ||
+        h->event_size != sizeof(event_t) || h->lat_size != sizeof(lat_set_t) ||
+        h->nnodes < 0 || h->ncars < 0 || h->nevents < 0 || h->nevents > INT32_MAX ||
+        h->source < SNAP_SRC_ARRAY || h->source > SNAP_SRC_GEN) {
+        fprintf(stderr, "%s: not a version %d snapshot written by this build\n",
+                path, SNAP_VERSION);
+        exit(1);
+    }
+    // bound each count by the bytes left before multiplying, so a bad header can't wrap
+    size_t left = len - sizeof(*h);
+    int fits = (size_t)h->nnodes <= left / sizeof(sim_node_t);
+    if (fits) left -= h->nnodes * sizeof(sim_node_t);
+    fits = fits && (size_t)h->ncars <= left / sizeof(car_t);
+    if (fits) left -= h->ncars * sizeof(car_t);
+    fits = fits && (size_t)h->nevents <= left / sizeof(event_t);
+    if (fits) left -= h->nevents * sizeof(event_t);
+    if (!fits || (h->has_lat && left < sizeof(lat_set_t))) {
+        fprintf(stderr, "%s: truncated (%zu bytes is short of what the header lists)\n",
+                path, len);
+        exit(1);
+    }
+
+    snapshot_t *sn = calloc(1, sizeof(snapshot_t));
+    assert(sn != NULL);
+    sn->path = path;
+    sn->map = map;
+    sn->len = len;
+    sn->h = h;
+    const char *p = (const char *)map + sizeof(*h);
+    sn->nodes = (const sim_node_t *)p;
+    p += h->nnodes * sizeof(sim_node_t);
+    sn->cars = (const car_t *)p;
+    p += h->ncars * sizeof(car_t);
+    sn->events = (const event_t *)p;
+    p += h->nevents * sizeof(event_t);
+    sn->lat = h->has_lat ? (const lat_set_t *)p : NULL;
+    return sn;
+}
+
+void snap_close(snapshot_t *sn) {
+    munmap(sn->map, sn->len);
+    free(sn);
+}
+
+// Replace the state of s, freshly initialized and not started, with the
+// snapshot's; s's source then carries on where the snapshot's had got to.
+void snap_restore(sim_t *s, const snapshot_t *sn) {
+    const snap_header_t *h = sn->h;
+    snap_check_config(sn);
+    snap_source_restore(s->src, sn);
+
+    snap_cars_t t = {malloc((h->ncars + 1) * sizeof(car_t *)), h->ncars, 0, sn->path};
+    assert(t.cars != NULL);
+    for (long i = 0; i < t.n; i++) {
+        t.cars[i] = car_get(&s->cars);
+        *t.cars[i] = sn->cars[i];
+    }
+    for (long i = 0; i < t.n; i++) {
+        t.cars[i]->next = snap_deref(&t, t.cars[i]->next);
+        snap_check_car(&t, i, h->nnodes);
+    }
+    for (int k = 0; k < h->nnodes; k++) {
+        s->nodes[k] = sn->nodes[k];
+        snap_node_refs(&s->nodes[k], snap_deref, &t);
+        snap_check_node(&t, &s->nodes[k], k);
+    }
+
+    event_queue_t *eq = &s->events;
+    eq->cap = h->nevents > 64 ? (int)h->nevents : 64;
+    eq->heap = realloc(eq->heap, eq->cap * sizeof(event_t));
+    assert(eq->heap != NULL);
+    for (int i = 0; i < (int)h->nevents; i++) {
+        eq->heap[i] = sn->events[i];
+        eq->heap[i].car = snap_deref(&t, eq->heap[i].car);
+        snap_check_event(&t, &eq->heap[i], i, h->nnodes);
+    }
+    eq->size = (int)h->nevents;
+    eq->next_seq = h->next_seq;
+
+    s->clock = h->clock;
+    s->last_arrival = h->last_arrival;
+    s->active = h->active;
+    s->departed = h->departed;
+    if (s->lat != NULL && sn->lat != NULL) {
+        *s->lat = *sn->lat;
+        s->lat->next_spare = NULL;
+    }
+    free(t.cars);
+}
+
+// CPU placement ------------------------------------------------------------------
+// --pin puts worker i of the pool, a grid or a sweep on the i-th CPU of a list,
+// wrapping around. "auto" lists the CPUs we may run on one NUMA node after
+// another. Grid band i is worker i and bands are numbered across the grid,
+// so neighbouring bands, which hand cars to each other, share a node and
+// only the bands either side of a node boundary hand cars across it. Each
+// band sets up its own intersections once it runs (see grid_split), so
+// first-touch allocation puts them in its node's memory. The thread engine
+// has no owners: its intersection_t state is used by whichever car threads
+// are there, so it is padded (see "Intersection state") but not placed, and
+// --pin does not apply to it.
+
+int *pin_cpus;                 // NULL unless --pin
+int npin_cpus;
+
+// Parse a list like "0-3,8,10-11" into out[] in the order given; returns the
+// count, or -1 if it is malformed or longer than max.
+int parse_id_list(const char *s, int *out, int max) {
+    int n = 0;
+    while (*s != '\0') {
+        char *end;
+        long lo = strtol(s, &end, 10), hi = lo;
+        if (end == s || lo < 0) return -1;
+        if (*end == '-') {
+            s = end + 1;
+            hi = strtol(s, &end, 10);
+            if (end == s || hi < lo) return -1;
+        }
+        for (long id = lo; id <= hi; id++) {
+            if (n == max) return -1;
+            out[n++] = (int)id;
+        }
+        s = end;
+        if (*s == ',') {
+            if (*++s == '\0') return -1;   // "0," has an empty last element
+        } else if (*s != '\0') {
+            return -1;
+        }
+    }
+    return n;
+}
+
+// parse_id_list of the first line of a sysfs file; -1 if it is missing.
+int read_id_list(const char *path, int *out, int max) {
+    FILE *f = fopen(path, "r");
+    if (f == NULL) return -1;
+    char line[4096];
+    int n = -1;
+    if (fgets(line, sizeof(line), f) != NULL) {
+        line[strcspn(line, "\n")] = '\0';
+        n = parse_id_list(line, out, max);
+    }
+    fclose(f);
+    return n;
+}
+
+void pin_add(cpu_set_t *allowed, cpu_set_t *seen, int cpu) {
+    if (cpu >= CPU_SETSIZE || !CPU_ISSET(cpu, allowed) || CPU_ISSET(cpu, seen)) return;
+    CPU_SET(cpu, seen);
+    pin_cpus[npin_cpus++] = cpu;
+}
+
+// Set up --pin=auto or --pin=CPULIST; prints why and returns -1 if it can't.
+int pin_setup(const char *spec) {
+    cpu_set_t allowed, seen;
+    CPU_ZERO(&seen);
+    int rc = sched_getaffinity(0, sizeof(allowed), &allowed);
+    assert(rc == 0);
+    static int ids[CPU_SETSIZE];
+    free(pin_cpus);                 // the last --pin wins
+    pin_cpus = malloc(CPU_SETSIZE * sizeof(int));
+    assert(pin_cpus != NULL);
+    npin_cpus = 0;
+
+    if (strcmp(spec, "auto") == 0) {
+        static int cpus[CPU_SETSIZE];
+        int nnodes = read_id_list("/sys/devices/system/node/online", ids, CPU_SETSIZE);
+        for (int i = 0; i < nnodes; i++) {
+            char path[64];
+            snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", ids[i]);
+            int ncpus = read_id_list(path, cpus, CPU_SETSIZE);
+            for (int k = 0; k < ncpus; k++) pin_add(&allowed, &seen, cpus[k]);
+        }
+        // without a node list (or for CPUs it leaves out) take them in order
+        for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) pin_add(&allowed, &seen, cpu);
+        return 0;
+    }
+
+    int n = parse_id_list(spec, ids, CPU_SETSIZE);
+    if (n <= 0) {
+        fprintf(stderr, "--pin: bad CPU list '%s'\n", spec);
+        return -1;
+    }
+    for (int i = 0; i < n; i++) {
+        if (ids[i] >= CPU_SETSIZE || !CPU_ISSET(ids[i], &allowed)) {
+            fprintf(stderr, "--pin: CPU %d is not available\n", ids[i]);
+            return -1;
+        }
+        pin_cpus[npin_cpus++] = ids[i];   // repeats allowed: two workers a CPU
+    }
+    return 0;
+}
+
+// CPU of worker i, -1 if unpinned.
+int pin_cpu(int i) {
+    return pin_cpus != NULL ? pin_cpus[i % npin_cpus] : -1;
+}
+
+// Start worker i, already on its CPU so that it allocates near it.
+void pin_create(pthread_t *t, int i, void *(*start_routine)(void *), void *arg) {
+    if (pin_cpus == NULL) {
+        Pthread_create(t, NULL, start_routine, arg);
+        return;
+    }
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(pin_cpu(i), &set);
+    int rc = pthread_attr_setaffinity_np(&attr, sizeof(set), &set);
+    assert(rc == 0);
+    Pthread_create(t, &attr, start_routine, arg);
+    pthread_attr_destroy(&attr);
+}
+
+// Worker pool ------------------------------------------------------------------
+// Real-time execution of the same state machine on a fixed set of workers.
+// One worker at a time is the leader: it sleeps until the earliest event is
+// due, pops it, promotes a follower, and then advances that car. Resource
+// hand-offs happen inline while the event is handled. Memory is the event
+// heap plus the cars currently at the intersection, whatever the car count.
+
+typedef struct {
+    sim_t sim;
+    pthread_mutex_t lock;      // protects sim and the fields below
+    pthread_cond_t leader_cv;  // leader waits here for the next deadline
+    pthread_cond_t follower_cv;
+    int has_leader;
+    int done;
+} pool_t;
+
+void *PoolWorker(void *arg) {
+    pool_t *p = (pool_t *)arg;
+    log_rec_t *spare = NULL;   // swapped with the sim's log buffer per event
+    int spare_cap = 0;
+
+    Pthread_mutex_lock(&p->lock);
+    while (!p->done) {
+        if (p->has_leader) {
+            pthread_cond_wait(&p->follower_cv, &p->lock);
+            continue;
+        }
+
+        // Become the leader and wait for the earliest timer to fire
+        p->has_leader = 1;
+        event_t e;
+        int got = 0;
+        while (!p->done) {
+            if (p->sim.events.size == 0) {
+                p->done = 1;     // no pending events: every car has exited
+                pthread_cond_broadcast(&p->follower_cv);
+                break;
+            }
+            double due = p->sim.events.heap[0].time;
+            if (due > now()) {
+                struct timespec ts = deadline_at(due);
+                pthread_cond_timedwait(&p->leader_cv, &p->lock, &ts);
+                continue;
+            }
+            got = eq_pop(&p->sim.events, &e);
+            break;
+        }
+        p->has_leader = 0;
+        if (!got) break;
+        pthread_cond_signal(&p->follower_cv);
+
+        log_hold();
+        p->sim.clock = now();
+        log_stamped(p->sim.clock);
+        sim_handle(&p->sim, &e);
+        pthread_cond_signal(&p->leader_cv); // new events may be due sooner
+
+        // Log outside the sim lock. Synchronous printing takes print_lock
+        // first so lines still come out in the order events were handled.
+        log_rec_t *logs = p->sim.logs;
+        int nlogs = p->sim.nlogs, cap = p->sim.logs_cap;
+        p->sim.logs = spare;
+        p->sim.logs_cap = spare_cap;
+        p->sim.nlogs = 0;
+        if (log_mode == LOG_SYNC) {
+            Pthread_mutex_lock(&print_lock);
+            Pthread_mutex_unlock(&p->lock);
+            print_log_batch(logs, nlogs);
+            Pthread_mutex_unlock(&print_lock);
+        } else {
+            Pthread_mutex_unlock(&p->lock);
+            log_submit(logs, nlogs);
+        }
+        spare = logs;
+        spare_cap = cap;
+        Pthread_mutex_lock(&p->lock);
+    }
+    Pthread_mutex_unlock(&p->lock);
+    free(spare);
+    log_thread_done();
+    return NULL;
+}
+
+// Run all cars in real time on nworkers threads.
+void pool_run(car_source_t *src, int nworkers) {
+    pool_t p;
+    sim_init(&p.sim, src, sim_nodes_new(grid_nodes()));
+    Pthread_mutex_init(&p.lock, NULL);
+    pthread_condattr_t mono;
+    pthread_condattr_init(&mono);
+    pthread_condattr_setclock(&mono, CLOCK_MONOTONIC);  // see deadline_at
+    pthread_cond_init(&p.leader_cv, &mono);
+    pthread_condattr_destroy(&mono);
+    pthread_cond_init(&p.follower_cv, NULL);
+    p.has_leader = 0;
+    p.done = 0;
+
+    start_ns = GetNanos();
+    log_start(0);
+    sim_start(&p.sim);
+
+    pthread_t *workers = malloc(nworkers * sizeof(pthread_t));
+    assert(workers != NULL);
+    for (int i = 0; i < nworkers; i++) {
+        pin_create(&workers[i], i, PoolWorker, &p);
+    }
+    for (int i = 0; i < nworkers; i++) {
+        Pthread_join(workers[i], NULL);
+    }
+    assert(p.sim.active == 0);
+    log_stop();
+    if (p.sim.lat) latency_report(p.sim.lat);
+
+    free(workers);
+    free(p.sim.nodes);
+    sim_destroy(&p.sim);
+}
+
+
+// Partitioned grid ---------------------------------------------------------------
+// Real-time execution of a road grid on several workers. Each worker owns a
+// band of whole intersections (rows, or columns if the grid is wider than it
+// is tall) with its own sim_t and event heap, so workers share no locks. A
+// car that leaves one band for another is pushed onto the new band's inbox:
+// a lock-free stack (CAS on the head, linked through car_t.next) that the
+// owner empties with a single exchange. The link travel time is the slack
+// the owner has to pick it up. A feeder thread pulls cars from the source
+// and delivers each to the band of its entry node the same way, PART_AHEAD
+// seconds before it arrives.
+//
+// Handoffs are batched: cars for another band collect in an outbox and go
+// over in one CAS when the owner runs out of due events or has handled
+// PART_BATCH of them, so the receiver's inbox line moves between CPUs (and
+// sockets) once per batch instead of once per car.
+//
+// Owners sleep on a futex until their next event is due or a car lands in
+// their inbox; a pusher only makes the wake syscall if the owner is asleep.
+
+#define PART_AHEAD 0.05
+#define PART_BATCH 32
+
+// Cars bound for one other band, newest first like an inbox.
+typedef struct {
+    car_t *head;
+    car_t *tail;
+} part_batch_t;
+
+typedef struct part {
+    sim_t sim;
+    struct grid_run *run;
+    int first, last;             // rows (or columns) owned
+    long events;                 // events handled
+    double max_late;             // worst handled - due (seconds)
+    sim_node_t *nodes;           // the intersections we own, on pages of our own
+    int nnodes;
+    part_batch_t *out;           // outbox for each band, indexed like parts
+    int held;                    // cars in the outboxes
+    long handed, batches;        // cars handed to other bands, and CASes
+
+    // written by other bands: on a line of its own
+    _Alignas(64) _Atomic(car_t *) inbox;
+    _Atomic uint32_t sleeping;   // futex word: 1 while the owner may sleep
+} part_t;
+
+typedef struct grid_run {
+    part_t *parts;
+    int nparts;
+    sim_node_t **node_at;        // sim_t.node_at of every band
+    int by_cols;                 // bands are columns
+    _Atomic long in_grid;        // cars delivered and not yet departed
+    _Atomic int feed_done;       // the feeder has delivered every car
+} grid_run_t;
+
+// Worker owning node n.
+int part_of(grid_run_t *g, int n) {
+    int band = g->by_cols ? n % cfg->grid.cols : n / cfg->grid.cols;
+    int nbands = g->by_cols ? cfg->grid.cols : cfg->grid.rows;
+    return (int)((long)band * g->nparts / nbands);
+}
+
+int grid_finished(grid_run_t *g) {
+    return atomic_load(&g->feed_done) && atomic_load(&g->in_grid) == 0;
+}
+
+void part_wake(part_t *pt) {
+    if (atomic_exchange(&pt->sleeping, 0)) Futex_wake_all(&pt->sleeping);
+}
+
+// Push the cars head..tail (linked through car_t.next) onto pt's inbox.
+void part_push(part_t *pt, car_t *head, car_t *tail) {
+    car_t *old = atomic_load(&pt->inbox);
+    do {
+        tail->next = old;
+    } while (!atomic_compare_exchange_weak(&pt->inbox, &old, head));
+    part_wake(pt);
+}
+
+// sim_t.forward: keep the car if we own its next node, else put it in the
+// outbox for the band that does.
+void part_forward(sim_t *s, car_t *c) {
+    part_t *pt = s->owner;
+    int to = part_of(pt->run, c->node);
+    if (&pt->run->parts[to] == pt) {
+        sim_enter(s, c);
+        return;
+    }
+    part_batch_t *b = &pt->out[to];
+    c->next = b->head;
+    b->head = c;
+    if (b->tail == NULL) b->tail = c;
+    pt->held++;
+}
+
+// Hand every outbox over.
+void part_flush(part_t *pt) {
+    if (pt->held == 0) return;
+    for (int i = 0; i < pt->run->nparts; i++) {
+        part_batch_t *b = &pt->out[i];
+        if (b->head == NULL) continue;
+        part_push(&pt->run->parts[i], b->head, b->tail);
+        b->head = b->tail = NULL;
+        pt->batches++;
+    }
+    pt->handed += pt->held;
+    pt->held = 0;
+}
+
+// Set up the intersections pt owns, from its own thread (see "CPU
+// placement").
+void part_init_nodes(part_t *pt) {
+    for (int k = 0; k < pt->nnodes; k++) {
+        sim_node_init(&pt->nodes[k]);
+    }
+}
+
+// Sleep until deadline (GetMonoTime seconds, INFINITY for none), a push, or
+// the end of the run. Raising `sleeping` before the final checks means a
+// pusher or finisher either is seen here or sees us asleep.
+void part_sleep(part_t *pt, double deadline) {
+    atomic_store(&pt->sleeping, 1);
+    if (atomic_load(&pt->inbox) == NULL && !grid_finished(pt->run)) {
+        if (deadline == INFINITY) Futex_wait(&pt->sleeping, 1);
+        else                      Futex_wait_until(&pt->sleeping, 1, deadline);
+    }
+    atomic_store(&pt->sleeping, 0);
+}
+
+// Everybody can stop once the last car has departed.
+void grid_check_finished(grid_run_t *g) {
+    if (!grid_finished(g)) return;
+    for (int i = 0; i < g->nparts; i++) part_wake(&g->parts[i]);
+}
+
+void *PartWorker(void *arg) {
+    part_t *pt = (part_t *)arg;
+    grid_run_t *g = pt->run;
+    sim_t *s = &pt->sim;
+    part_init_nodes(pt);   // cars only reach our nodes through us
+
+    for (;;) {
+        // take in everything pushed to us, oldest first
+        car_t *c = atomic_exchange(&pt->inbox, NULL), *fifo = NULL;
+        while (c != NULL) {
+            car_t *next = c->next;
+            c->next = fifo;
+            fifo = c;
+            c = next;
+        }
+        while (fifo != NULL) {
+            car_t *next = fifo->next;
+            sim_enter(s, fifo);
+            fifo = next;
+        }
+
+        if (s->events.size == 0) {
+            part_flush(pt);
+            if (grid_finished(g)) break;
+            part_sleep(pt, INFINITY);
+            continue;
+        }
+        double due = s->events.heap[0].time;
+        if (due > now()) {
+            part_flush(pt);
+            part_sleep(pt, mono_at(due));
+            continue;
+        }
+
+        event_t e;
+        eq_pop(&s->events, &e);
+        log_hold();
+        s->clock = now();
+        log_stamped(s->clock);
+        if (s->clock - due > pt->max_late) pt->max_late = s->clock - due;
+
+        long departed = s->departed;
+        sim_handle(s, &e);
+        sim_flush_logs(s);
+        pt->events++;
+        if (pt->events % PART_BATCH == 0) part_flush(pt);
+        if (s->departed != departed) {
+            atomic_fetch_sub(&g->in_grid, s->departed - departed);
+            grid_check_finished(g);
+        }
+    }
+    log_thread_done();
+    return NULL;
+}
+
+// Split the grid into bands for up to nworkers owners. Each band's
+// intersections get a mapping of their own, so no page holds two bands'
+// nodes whether the bands are rows or columns, and the pages are left
+// untouched for the owner to set up (part_init_nodes). Free with grid_free.
+void grid_split(grid_run_t *g, int nworkers) {
+    g->by_cols = cfg->grid.cols > cfg->grid.rows;
+    int nbands = g->by_cols ? cfg->grid.cols : cfg->grid.rows;
+    g->nparts = nworkers < nbands ? nworkers : nbands;
+    g->parts = aligned_alloc(64, g->nparts * sizeof(part_t));
+    assert(g->parts != NULL);
+    memset(g->parts, 0, g->nparts * sizeof(part_t));
+    atomic_store(&g->in_grid, 0);
+    atomic_store(&g->feed_done, 0);
+
+    int nnodes = grid_nodes();
+    g->node_at = malloc(nnodes * sizeof(sim_node_t *));
+    assert(g->node_at != NULL);
+    for (int n = 0; n < nnodes; n++) g->parts[part_of(g, n)].nnodes++;
+    for (int i = 0; i < g->nparts; i++) {
+        part_t *pt = &g->parts[i];
+        pt->nodes = mmap(NULL, pt->nnodes * sizeof(sim_node_t), PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        assert(pt->nodes != MAP_FAILED);
+        pt->nnodes = 0;    // counts them again below
+    }
+    for (int n = 0; n < nnodes; n++) {
+        part_t *pt = &g->parts[part_of(g, n)];
+        g->node_at[n] = &pt->nodes[pt->nnodes++];
+    }
+
+    for (int i = 0; i < g->nparts; i++) {
+        part_t *pt = &g->parts[i];
+        sim_init(&pt->sim, NULL, NULL);
+        pt->sim.node_at = g->node_at;
+        pt->sim.forward = part_forward;
+        pt->sim.owner = pt;
+        pt->run = g;
+        pt->first = -1;
+        pt->out = calloc(g->nparts, sizeof(part_batch_t));
+        assert(pt->out != NULL);
+    }
+    for (int b = 0; b < nbands; b++) {
+        part_t *pt = &g->parts[part_of(g, g->by_cols ? b : b * cfg->grid.cols)];
+        if (pt->first < 0) pt->first = b;
+        pt->last = b;
+    }
+}
+
+void grid_free(grid_run_t *g) {
+    for (int i = 0; i < g->nparts; i++) {
+        part_t *pt = &g->parts[i];
+        munmap(pt->nodes, pt->nnodes * sizeof(sim_node_t));
+        free(pt->out);
+    }
+    free(g->node_at);
+    free(g->parts);
+}
+
+// Run a grid in real time on up to nworkers band owners; the calling thread
+// is the feeder.
+void part_run(car_source_t *src, int nworkers) {
+    grid_run_t g;
+    grid_split(&g, nworkers);
+    car_pool_t feed_cars;        // ours; the bands give departed cars back
+    memset(&feed_cars, 0, sizeof(feed_cars));
+    for (int i = 0; i < g.nparts; i++) {
+        g.parts[i].sim.pool = &feed_cars;
+        g.parts[i].sim.pool_remote = 1;
+    }
+
+    start_ns = GetNanos();
+    log_start(0);
+
+    pthread_t *workers = malloc(g.nparts * sizeof(pthread_t));
+    assert(workers != NULL);
+    for (int i = 0; i < g.nparts; i++) {
+        pin_create(&workers[i], i, PartWorker, &g.parts[i]);
+    }
+
+    // feed: deliver each car a little ahead of its arrival time
+    car_t next;
+    while (src->next(src, &next)) {
+        double lead = next.arrival_time - PART_AHEAD - now();
+        if (lead > 0) SleepUntil(mono_at(next.arrival_time - PART_AHEAD));
+        car_t *c = car_get(&feed_cars);
+        *c = next;
+        c->quads_held = 0;
+        atomic_fetch_add(&g.in_grid, 1);
+        part_push(&g.parts[part_of(&g, c->node)], c, c);
+    }
+    atomic_store(&g.feed_done, 1);
+    grid_check_finished(&g);
+
+    for (int i = 0; i < g.nparts; i++) {
+        Pthread_join(workers[i], NULL);
+    }
+    log_stop();
+
+    lat_set_t *lat = latency_on ? calloc(1, sizeof(lat_set_t)) : NULL;
+    for (int i = 0; i < g.nparts; i++) {
+        part_t *pt = &g.parts[i];
+        assert(pt->sim.active == 0);
+        printf("Partition %d: %s %d-%d, %ld events, max lateness %.3f ms, "
+               "%ld cars handed over in %ld batches",
+               i, g.by_cols ? "columns" : "rows", pt->first, pt->last,
+               pt->events, pt->max_late * 1e3, pt->handed, pt->batches);
+        if (pin_cpus != NULL) printf(", CPU %d", pin_cpu(i));
+        printf("\n");
+        if (lat) latency_merge(lat, pt->sim.lat);
+        sim_destroy(&pt->sim);
+    }
+    if (lat) latency_report(lat);
+
+    free(lat);
+    free(workers);
+    car_pool_destroy(&feed_cars);
+    grid_free(&g);
+}
+
+// Parallel grid simulation -------------------------------------------------------
+// -e pdes runs the grid bands of "Partitioned grid" on the virtual clock,
+// in parallel, with conservative synchronization in lockstep windows. A car
+// leaving an intersection at time t arrives at the next one at t + link_time,
+// and nothing else crosses between intersections, so the link time is the
+// lookahead: if the earliest pending event anywhere is at T, every band can
+// handle all its events before T + link_time without hearing from another
+// band first. Cars handed over during a window land in the receiving band's
+// inbox and are queued by the next window.
+//
+// Each window is three barriers:
+//   1. every band has finished the window and queued its inbox
+//   2. band 0 prints the window's log lines, picks the next window end and
+//      queues the source's cars arriving before it
+//   3. everybody handles the new window
+//
+// The output is identical to -e des: events at one intersection are ordered
+// by (time, car id) whichever engine holds them (eq_push), and band 0 merges
+// the bands' log lines of each window in that order.
+
+// A log line plus the key of the event that produced it.
+typedef struct {
+    log_rec_t rec;
+    long seq;
+} pdes_line_t;
+
+// Per-band state of a window, a cache line each.
+typedef struct {
+    _Alignas(64) pdes_line_t *lines;  // log lines of the current window, in order
+    int nlines;
+    int cap;
+    double next;             // earliest queued event, INFINITY if none
+} pdes_band_t;
+
+typedef struct {
+    grid_run_t g;            // first: part_t.run leads back here
+    pdes_band_t *bands;      // indexed like g.parts
+    pthread_barrier_t barrier;
+
+    car_source_t *src;
+    car_t pending;           // next car from src, valid if have_pending
+    int have_pending;
+    car_pool_t feed_cars;    // band 0's, for the cars it queues
+
+    double window_end;       // handle events before this time
+    int done;
+    long windows;
+
+    log_rec_t *merged;       // band 0's output buffer
+    int merged_cap;
+} pdes_t;
+
+// Keep the log lines of the event just handled, tagged with its key.
+void pdes_keep_logs(pdes_band_t *b, sim_t *s, long seq) {
+    if (log_quiet) {
+        s->nlogs = 0;
+        return;
+    }
+    if (b->nlines + s->nlogs > b->cap) {
+        while (b->nlines + s->nlogs > b->cap) b->cap = b->cap ? b->cap * 2 : 256;
+        b->lines = realloc(b->lines, b->cap * sizeof(pdes_line_t));
+        assert(b->lines != NULL);
+    }
+    for (int i = 0; i < s->nlogs; i++) {
+        b->lines[b->nlines].rec = s->logs[i];
+        b->lines[b->nlines].seq = seq;
+        b->nlines++;
+    }
+    s->nlogs = 0;
+}
+
+int pdes_line_before(const pdes_line_t *a, const pdes_line_t *b) {
+    if (a->rec.t != b->rec.t) return a->rec.t < b->rec.t;
+    return a->seq < b->seq;
+}
+
+// Print every band's lines of the last window in sequential order. A band's
+// lines are already sorted and no two bands share a key, so this is a plain
+// k-way merge; lines of one event stay together in their original order.
+void pdes_merge_logs(pdes_t *p) {
+    int total = 0;
+    for (int i = 0; i < p->g.nparts; i++) total += p->bands[i].nlines;
+    if (total == 0) return;
+    if (total > p->merged_cap) {
+        p->merged_cap = total;
+        p->merged = realloc(p->merged, total * sizeof(log_rec_t));
+        assert(p->merged != NULL);
+    }
+
+    int pos[p->g.nparts];
+    memset(pos, 0, sizeof(pos));
+    for (int n = 0; n < total; n++) {
+        int best = -1;
+        for (int i = 0; i < p->g.nparts; i++) {
+            pdes_band_t *b = &p->bands[i];
+            if (pos[i] < b->nlines &&
+                (best < 0 || pdes_line_before(&b->lines[pos[i]],
+                                              &p->bands[best].lines[pos[best]]))) {
+                best = i;
+            }
+        }
+        p->merged[n] = p->bands[best].lines[pos[best]++].rec;
+    }
+    for (int i = 0; i < p->g.nparts; i++) p->bands[i].nlines = 0;
+    log_submit(p->merged, total);
+}
+
+// A record for a new car. Cars leave in whichever band they finish, so when
+// our pool runs dry take over a band's free list (the bands are parked).
+car_t *pdes_new_car(pdes_t *p) {
+    for (int i = 0; p->feed_cars.free == NULL && i < p->g.nparts; i++) {
+        car_pool_t *band = &p->g.parts[i].sim.cars;
+        p->feed_cars.free = band->free;
+        band->free = NULL;
+    }
+    return car_get(&p->feed_cars);
+}
+
+void pdes_pull(pdes_t *p) {
+    p->have_pending = p->src->next(p->src, &p->pending);
+}
+
+// Band 0, between windows: flush the last one and set up the next.
+void pdes_next_window(pdes_t *p) {
+    pdes_merge_logs(p);
+
+    double t = p->have_pending ? p->pending.arrival_time : INFINITY;
+    for (int i = 0; i < p->g.nparts; i++) {
+        if (p->bands[i].next < t) t = p->bands[i].next;
+    }
+    if (t == INFINITY) {
+        p->done = 1;
+        return;
+    }
+    p->window_end = t + cfg->grid.link_time;
+    p->windows++;
+
+    // the other bands are parked at the barrier, so their queues are ours
+    while (p->have_pending && p->pending.arrival_time < p->window_end) {
+        car_t *c = pdes_new_car(p);
+        *c = p->pending;
+        c->quads_held = 0;
+        sim_enter(&p->g.parts[part_of(&p->g, c->node)].sim, c);
+        pdes_pull(p);
+    }
+}
+
+void *PdesWorker(void *arg) {
+    part_t *pt = (part_t *)arg;
+    pdes_t *p = (pdes_t *)pt->run;
+    int me = (int)(pt - p->g.parts);
+    pdes_band_t *b = &p->bands[me];
+    sim_t *s = &pt->sim;
+    part_init_nodes(pt);   // before the first barrier, so before any events
+
+    for (;;) {
+        // queue the cars handed to us during the last window
+        car_t *c = atomic_exchange(&pt->inbox, NULL);
+        while (c != NULL) {
+            car_t *next = c->next;
+            sim_enter(s, c);
+            c = next;
+        }
+        b->next = s->events.size > 0 ? s->events.heap[0].time : INFINITY;
+
+        Pthread_barrier_wait(&p->barrier);
+        if (me == 0) pdes_next_window(p);
+        Pthread_barrier_wait(&p->barrier);
+        if (p->done) break;
+
+        event_t e;
+        while (s->events.size > 0 && s->events.heap[0].time < p->window_end) {
+            eq_pop(&s->events, &e);
+            s->clock = e.time;
+            sim_handle(s, &e);
+            pdes_keep_logs(b, s, e.seq);
+            pt->events++;
+        }
+        part_flush(pt);      // the receivers only look after the barrier
+        Pthread_barrier_wait(&p->barrier);
+    }
+    log_thread_done();
+    return NULL;
+}
+
+// Simulate a grid on the virtual clock with up to nworkers bands in parallel.
+void pdes_run(car_source_t *src, int nworkers) {
+    pdes_t p;
+    memset(&p, 0, sizeof(p));
+    grid_split(&p.g, nworkers);
+    p.bands = aligned_alloc(64, p.g.nparts * sizeof(pdes_band_t));
+    assert(p.bands != NULL);
+    memset(p.bands, 0, p.g.nparts * sizeof(pdes_band_t));
+    Pthread_barrier_init(&p.barrier, p.g.nparts);
+    p.src = src;
+    pdes_pull(&p);
+
+    log_start(1);
+    pthread_t *workers = malloc(p.g.nparts * sizeof(pthread_t));
+    assert(workers != NULL);
+    for (int i = 0; i < p.g.nparts; i++) {
+        pin_create(&workers[i], i, PdesWorker, &p.g.parts[i]);
+    }
+    for (int i = 0; i < p.g.nparts; i++) {
+        Pthread_join(workers[i], NULL);
+    }
+    log_stop();
+
+    // stdout stays byte-for-byte what -e des prints, so stats go to stderr
+    fprintf(stderr, "pdes: %ld windows, lookahead %.3f s\n", p.windows, cfg->grid.link_time);
+    lat_set_t *lat = latency_on ? calloc(1, sizeof(lat_set_t)) : NULL;
+    for (int i = 0; i < p.g.nparts; i++) {
+        part_t *pt = &p.g.parts[i];
+        assert(pt->sim.active == 0);
+        fprintf(stderr, "Partition %d: %s %d-%d, %ld events, "
+                "%ld cars handed over in %ld batches",
+                i, p.g.by_cols ? "columns" : "rows", pt->first, pt->last, pt->events,
+                pt->handed, pt->batches);
+        if (pin_cpus != NULL) fprintf(stderr, ", CPU %d", pin_cpu(i));
+        fprintf(stderr, "\n");
+        if (lat) latency_merge(lat, pt->sim.lat);
+        sim_destroy(&pt->sim);
+        free(p.bands[i].lines);
+    }
+    if (lat) latency_report(lat);
+
+    pthread_barrier_destroy(&p.barrier);
+    free(lat);
+    free(p.merged);
+    free(workers);
+    car_pool_destroy(&p.feed_cars);
+    free(p.bands);
+    grid_free(&p.g);
+}
+
+// Car thread ------------------------------------------------------------
+// The thread sleeps until arrival time,
+// then performs ARRIVE → CROSS → EXIT in order
+// (on a grid: at every intersection of its route, link_time apart).
+// Its car_t lives on its own stack, expanded from the car table.
+
+// Stack per car thread: the car, a few frames and printf.
+#define CAR_STACK_SIZE (64 * 1024)
+
+car_table_t run_cars;      // the thread engine's cars
+
+void *Car(void *arg) {
+    car_t car;
+    car_t *c = &car;
+    car_table_get(&run_cars, (long)(intptr_t)arg, c);
+
+    // sleep until its arrival time
+    SleepUntil(mono_at(c->arrival_time));
+
+    for (;;) {
+        intersection_t *x = &isects[c->node];
+        if (cfg->grid_on) grid_route(c);
+
+        // Perform the three actions in order
+        if (metrics_on) metrics_arrived(c);
+        ArriveIntersection(x, c);
+        if (metrics_on) metrics_granted(c);
+        CrossIntersection(x, c);
+        ExitIntersection(x, c);
+        if (metrics_on) metrics_exited(c);
+
+        if (!cfg->grid_on || !grid_advance(c, now() + cfg->grid.link_time)) break;
+        sim_sleep(cfg->grid.link_time);
+    }
+
+    if (run_cars.cross_drift) run_cars.cross_drift[c->index] = c->cross_drift;
+    log_thread_done();
+    latency_thread_done();
+    metrics_thread_done();
+    return NULL;
+}
+
+// Thread-per-car engine --------------------------------------------------------
+
+// Run every car from src on its own pthread in real time. Each thread needs
+// its car for the whole run, so the source is read into memory first.
+void thread_run(car_source_t *src) {
+    car_table_load(&run_cars, src);
+    long n = run_cars.n;
+    if (cross_mode == CROSS_SLEEP) {
+        run_cars.cross_drift = calloc(n ? n : 1, sizeof(double));
+        assert(run_cars.cross_drift != NULL);
+    }
+
+    nisects = grid_nodes();
+    isects = aligned_alloc(64, nisects * sizeof(intersection_t));
+    assert(isects != NULL);
+    for (int i = 0; i < nisects; i++) {
+        isect_init(&isects[i]);
+    }
+
+    /// Mark simulation start time
+    start_ns = GetNanos();
+    log_start(0);
+
+    // Create car threads
+    pthread_t *tids = malloc(n * sizeof(pthread_t));
+    assert(tids != NULL);
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    int rc = pthread_attr_setstacksize(&attr, CAR_STACK_SIZE);
+    assert(rc == 0);
+
+    // Create one thread for each car
+    for (long i = 0; i < n; i++) {
+        Pthread_create(&tids[i], &attr, Car, (void *)(intptr_t)i);
+    }
+    pthread_attr_destroy(&attr);
+
+    // Wait for all cars to finish
+    for (long i = 0; i < n; i++) {
+        Pthread_join(tids[i], NULL);
+    }
+    free(tids);
+    log_stop();
+
+    // Report how far each sleeping crossing overshot its nominal time
+    if (run_cars.cross_drift) {
+        printf("Crossing drift (actual - nominal):\n");
+        for (long i = 0; i < n; i++) {
+            printf("  Car %d: %+.3f ms\n", run_cars.cid[i], run_cars.cross_drift[i] * 1e3);
+        }
+    }
+    if (latency_on) latency_report(&lat_total);
+
+    car_table_free(&run_cars);
+    free(isects);
+}
+
+
+// Benchmarks -----------------------------------------------------------------------
+// --bench=sim|cpu runs a fixed set of workloads under the current run options
+// and prints one JSON object, so two builds (or two admission settings) can
+// be compared run for run:
+//   sim  each workload on the event engine: simulated throughput and the
+//        distribution of wait beyond the stop
+//   cpu  the real ArriveIntersection/CrossIntersection/ExitIntersection
+//        with zero stop and crossing time, the cars shared round-robin by
+//        -w threads that each take their cars through one after another;
+//        wall and CPU ns per car and context switches per car (getrusage)
+// Workloads are seeded, so every run of a build sees the same cars.
+
+#define BENCH_CARS     2000      // cars per generated workload
+#define BENCH_CPU_CARS 200000    // car passes per workload in the cpu bench
+#define BENCH_SEED     1
+
+typedef struct {
+    const char *name;
+    int builtin;                 // the hard-coded cars[] instead of a generator
+    double rate[4];
+    double mix[3];
+    int platoon;
+} bench_workload_t;
+
+const bench_workload_t bench_workloads[] = {
+    {.name = "example", .builtin = 1},
+    {"uniform",    0, {0.04, 0.04, 0.04, 0.04}, {1, 1, 1}, 1},
+    {"left-heavy", 0, {0.04, 0.04, 0.04, 0.04}, {4, 1, 1}, 1},
+    {"platoon",    0, {0.15, 0, 0, 0},          {1, 1, 1}, 8},  // one approach
+    {"saturated",  0, {0.25, 0.25, 0.25, 0.25}, {1, 1, 1}, 1},
+};
+#define NUM_BENCH_WORKLOADS (int)(sizeof(bench_workloads) / sizeof(bench_workloads[0]))
+
+// Source for workload w (g is its storage).
+car_source_t *bench_source(const bench_workload_t *w, gen_source_t *g, array_source_t *a) {
+    if (w->builtin) {
+        array_source_init(a, cars, NUM_CARS);
+        return &a->base;
+    }
+    memset(g, 0, sizeof(*g));
+    memcpy(g->rate, w->rate, sizeof(g->rate));
+    memcpy(g->mix, w->mix, sizeof(g->mix));
+    g->platoon = w->platoon;
+    g->headway = 1.0;
+    g->limit = BENCH_CARS;
+    gen_source_init(g, BENCH_SEED);
+    return &g->base;
+}
+
+void bench_print_config(const run_config_t *rc) {
+    static const char *flow_names[] = {"serial", "pipelined"};
+    static const char *admission_names[] = {"direction", "conflict"};
+    static const char *quad_names[] = {"mutex", "mask"};
+    static const char *wakeup_names[] = {"broadcast", "targeted"};
+    printf("  \"config\": {\"flow\": \"%s\", \"admission\": \"%s\", \"quads\": \"%s\", "
+           "\"wakeup\": \"%s\", \"sched\": \"%s\", \"flow_cap\": %d, "
+           "\"starve_limit\": %d, \"stop\": %g, \"cross_time\": [%g, %g, %g], "
+           "\"signal\": \"%s\"},\n",
+           flow_names[rc->flow_mode], admission_names[rc->admission],
+           quad_names[rc->quad_mode], wakeup_names[rc->wakeup_mode],
+           sched_names[rc->sched_policy], rc->flow_cap, rc->starve_limit,
+           rc->stop_time, rc->cross_time[0], rc->cross_time[1], rc->cross_time[2],
+           signal_names[rc->signal]);
+}
+
+void bench_sim() {
+    printf("{\n  \"bench\": \"sim\",\n");
+    bench_print_config(cfg);
+    printf("  \"workloads\": [\n");
+    for (int k = 0; k < NUM_BENCH_WORKLOADS; k++) {
+        gen_source_t g;
+        array_source_t a;
+        car_source_t *src = bench_source(&bench_workloads[k], &g, &a);
+
+        sim_summary_t sum;
+        double begin = GetMonoTime();
+        sim_summarize(src, &sum);
+        double wall = GetMonoTime() - begin;
+
+        const hist_t *h = &sum.wait;
+        printf("    {\"name\": \"%s\", \"cars\": %ld, \"makespan\": %.3f, "
+               "\"cars_per_hour\": %.3f, \"wait\": {\"mean\": %.6f, \"p50\": %.6f, "
+               "\"p90\": %.6f, \"p99\": %.6f, \"max\": %.6f}, \"wall_ms\": %.3f}%s\n",
+               bench_workloads[k].name, sum.cars, sum.makespan,
+               sum.makespan > 0 ? sum.cars * 3600.0 / sum.makespan : 0.0,
+               HistMean(h) / 1e6, HistQuantile(h, 0.50) / 1e6, HistQuantile(h, 0.90) / 1e6,
+               HistQuantile(h, 0.99) / 1e6, HistQuantile(h, 1.0) / 1e6, wall * 1e3,
+               k + 1 < NUM_BENCH_WORKLOADS ? "," : "");
+    }
+    printf("  ]\n}\n");
+}
+
+// One cpu-bench thread and its share of the cars.
+typedef struct {
+    const run_config_t *cfg;
+    intersection_t *x;
+    const car_t *cars;
+    long n;
+    int id, nthreads;
+    long passes;                 // times through the car list
+} bench_thread_t;
+
+void *BenchCar(void *arg) {
+    bench_thread_t *b = (bench_thread_t *)arg;
+    cfg = b->cfg;
+    for (long p = 0; p < b->passes; p++) {
+        for (long i = b->id; i < b->n; i += b->nthreads) {
+            car_t c = b->cars[i];
+            ArriveIntersection(b->x, &c);
+            CrossIntersection(b->x, &c);
+            ExitIntersection(b->x, &c);
+        }
+    }
+    log_thread_done();
+    latency_thread_done();
+    return NULL;
+}
+
+double rusage_seconds(const struct rusage *r) {
+    return r->ru_utime.tv_sec + r->ru_utime.tv_usec / 1e6 +
+           r->ru_stime.tv_sec + r->ru_stime.tv_usec / 1e6;
+}
+
+void bench_cpu(int nthreads) {
+    run_config_t rc = *cfg;
+    rc.stop_time = 0;
+    rc.cross_time[0] = rc.cross_time[1] = rc.cross_time[2] = 0;
+
+    printf("{\n  \"bench\": \"cpu\",\n  \"threads\": %d,\n", nthreads);
+    bench_print_config(&rc);
+    printf("  \"workloads\": [\n");
+    for (int k = 0; k < NUM_BENCH_WORKLOADS; k++) {
+        gen_source_t g;
+        array_source_t a;
+        car_source_t *src = bench_source(&bench_workloads[k], &g, &a);
+        long n = 0, cap = 0;
+        car_t *list = NULL, c;
+        while (src->next(src, &c)) {
+            if (n == cap) {
+                cap = cap ? cap * 2 : 64;
+                list = realloc(list, cap * sizeof(car_t));
+                assert(list != NULL);
+            }
+            list[n++] = c;
+        }
+        long passes = (BENCH_CPU_CARS + n - 1) / n;
+        int t = nthreads < n ? nthreads : (int)n;
+
+        intersection_t x;
+        isect_init(&x);
+        bench_thread_t *bt = calloc(t, sizeof(bench_thread_t));
+        pthread_t *tids = malloc(t * sizeof(pthread_t));
+        assert(bt != NULL && tids != NULL);
+
+        struct rusage r0, r1;
+        getrusage(RUSAGE_SELF, &r0);
+        start_ns = GetNanos();
+        double begin = GetMonoTime();
+        for (int i = 0; i < t; i++) {
+            bt[i] = (bench_thread_t){&rc, &x, list, n, i, t, passes};
+            Pthread_create(&tids[i], NULL, BenchCar, &bt[i]);
+        }
+        for (int i = 0; i < t; i++) {
+            Pthread_join(tids[i], NULL);
+        }
+        double wall = GetMonoTime() - begin;
+        getrusage(RUSAGE_SELF, &r1);
+
+        double total = (double)passes * n;
+        long csw = (r1.ru_nvcsw - r0.ru_nvcsw) + (r1.ru_nivcsw - r0.ru_nivcsw);
+        printf("    {\"name\": \"%s\", \"cars\": %.0f, \"ns_per_car\": %.1f, "
+               "\"cpu_ns_per_car\": %.1f, \"ctx_switches_per_car\": %.4f}%s\n",
+               bench_workloads[k].name, total, wall * 1e9 / total,
+               (rusage_seconds(&r1) - rusage_seconds(&r0)) * 1e9 / total, csw / total,
+               k + 1 < NUM_BENCH_WORKLOADS ? "," : "");
+        fflush(stdout);
+
+        free(tids);
+        free(bt);
+        free(list);
+    }
+    printf("  ]\n}\n");
+}
+
+// Run options -------------------------------------------------------------------
+// The command-line options that shape one run: run_config_t plus the traffic
+// generator. main applies them to config; --sweep applies them to every
+// point of a sweep.
+
+// Parse up to max comma-separated finite, non-negative numbers into out[];
+// return how many were read (or -1 on malformed input).
+int parse_doubles(const char *arg, double out[], int max) {
+    int n = 0;
+    const char *p = arg;
+    while (n < max) {
+        char *end;
+        double v = strtod(p, &end);
+        if (end == p || !isfinite(v) || v < 0) return -1;   // no nan or inf
+        out[n++] = v;
+        if (*end == '\0') return n;
+        if (*end != ',') return -1;
+        p = end + 1;
+    }
+    return -1;
+}
+
+// Parse a signal plan: comma-separated phases APPROACHES/TURNS=SECONDS, e.g.
+// NS/SR=30 for north and south going straight or right. Every movement must
+// be green in some phase. Return 1, or 0 on malformed input.
+int parse_phases(const char *arg, run_config_t *rc) {
+    static const char turn_chars[] = "LSR";   // turn_t order
+    int n = 0, covered = 0;
+    const char *p = arg;
+    for (;;) {
+        if (n == MAX_PHASES) return 0;
+        int a = 0, t = 0;
+        for (; *p != '/'; p++) {
+            const char *k = strchr("NESW", *p);
+            if (*p == '\0' || k == NULL) return 0;
+            a |= 1 << (k - "NESW");
+        }
+        for (p++; *p != '='; p++) {
+            const char *k = strchr(turn_chars, *p);
+            if (*p == '\0' || k == NULL) return 0;
+            t |= 1 << (k - turn_chars);
+        }
+        char *end;
+        double secs = strtod(p + 1, &end);
+        if (end == p + 1 || !isfinite(secs) || secs <= 0 || a == 0 || t == 0) return 0;
+        rc->phases[n].green = PHASE_GREEN(a, t);
+        rc->phases[n].time = secs;
+        covered |= rc->phases[n].green;
+        n++;
+        if (*end == '\0') break;
+        if (*end != ',') return 0;
+        p = end + 1;
+    }
+    if (covered != (1 << NUM_MOVES) - 1) return 0;   // someone would wait forever
+    rc->nphases = n;
+    return 1;
+}
+
+// Apply option name (its long name) with value val. Return 1, 0 if val is
+// malformed, or -1 if name is not a run option.
+int config_option(run_config_t *rc, gen_source_t *gen, uint64_t *seed,
+                  const char *name, const char *val) {
+    if (strcmp(name, "flow") == 0) {
+        if (strcmp(val, "serial") == 0)         rc->flow_mode = FLOW_SERIAL;
+        else if (strcmp(val, "pipelined") == 0) rc->flow_mode = FLOW_PIPELINED;
+        else return 0;
+    } else if (strcmp(name, "admission") == 0) {
+        if (strcmp(val, "direction") == 0)     rc->admission = ADMIT_DIRECTION;
+        else if (strcmp(val, "conflict") == 0) rc->admission = ADMIT_CONFLICT;
+        else return 0;
+    } else if (strcmp(name, "quads") == 0) {
+        if (strcmp(val, "mutex") == 0)     rc->quad_mode = QUADS_MUTEX;
+        else if (strcmp(val, "mask") == 0) rc->quad_mode = QUADS_MASK;
+        else return 0;
+    } else if (strcmp(name, "starve-limit") == 0) {
+        char *end;
+        long v = strtol(val, &end, 10);
+        if (end == val || *end != '\0' || v < 0 || v > INT_MAX) return 0;
+        rc->starve_limit = (int)v;
+    } else if (strcmp(name, "wakeup") == 0) {
+        if (strcmp(val, "broadcast") == 0)     rc->wakeup_mode = WAKE_BROADCAST;
+        else if (strcmp(val, "targeted") == 0) rc->wakeup_mode = WAKE_TARGETED;
+        else return 0;
+    } else if (strcmp(name, "sched") == 0) {
+        int k = 0;
+        while (k <= POLICY_MAXWEIGHT && strcmp(val, sched_names[k]) != 0) k++;
+        if (k > POLICY_MAXWEIGHT) return 0;
+        rc->sched_policy = (sched_policy_t)k;
+    } else if (strcmp(name, "flow-cap") == 0) {
+        char *end;
+        long v = strtol(val, &end, 10);
+        if (end == val || *end != '\0' || v < 0 || v > INT_MAX) return 0;
+        rc->flow_cap = (int)v;
+    } else if (strcmp(name, "grid") == 0) {
+        if (sscanf(val, "%dx%d", &rc->grid.rows, &rc->grid.cols) != 2 ||
+            rc->grid.rows < 1 || rc->grid.cols < 1) return 0;
+        rc->grid_on = 1;
+    } else if (strcmp(name, "link") == 0) {
+        if (parse_doubles(val, &rc->grid.link_time, 1) != 1 ||
+            rc->grid.link_time <= 0) return 0;
+    } else if (strcmp(name, "stop") == 0) {
+        if (parse_doubles(val, &rc->stop_time, 1) != 1) return 0;
+    } else if (strcmp(name, "cross-time") == 0) {
+        double t[3];
+        if (parse_doubles(val, t, 3) != 3) return 0;
+        memcpy(rc->cross_time, t, sizeof(t));
+    } else if (strcmp(name, "signal") == 0) {
+        int k = 0;
+        while (k <= SIGNAL_PRESSURE && strcmp(val, signal_names[k]) != 0) k++;
+        if (k > SIGNAL_PRESSURE) return 0;
+        rc->signal = (signal_mode_t)k;
+    } else if (strcmp(name, "phases") == 0) {
+        if (!parse_phases(val, rc)) return 0;
+    } else if (strcmp(name, "rate") == 0) {
+        int k = parse_doubles(val, gen->rate, 4);
+        if (k == 1) gen->rate[1] = gen->rate[2] = gen->rate[3] = gen->rate[0];
+        else if (k != 4) return 0;
+    } else if (strcmp(name, "mix") == 0) {
+        if (parse_doubles(val, gen->mix, 3) != 3 ||
+            gen->mix[0] + gen->mix[1] + gen->mix[2] <= 0) return 0;
+    } else if (strcmp(name, "platoon") == 0) {
+        double p[2] = {1, gen->headway};
+        if (parse_doubles(val, p, 2) < 1 || p[0] < 1) return 0;
+        gen->platoon = (int)p[0];
+        gen->headway = p[1];
+    } else if (strcmp(name, "cars") == 0) {
+        char *end;
+        gen->limit = strtol(val, &end, 10);   // 0 means unset, negative never stops
+        if (end == val || *end != '\0' || gen->limit <= 0) return 0;
+    } else if (strcmp(name, "duration") == 0) {
+        if (parse_doubles(val, &gen->duration, 1) != 1 || gen->duration <= 0) return 0;
+    } else if (strcmp(name, "seed") == 0) {
+        char *end;
+        *seed = strtoull(val, &end, 0);
+        if (end == val || *end != '\0' || val[0] == '-') return 0;
+    } else {
+        return -1;
+    }
+    return 1;
+}
+
+// Settle options that imply others, once all of them are known.
+void config_finish(run_config_t *rc, gen_source_t *gen) {
+    // a policy needs someone to apply it at the handover: targeted wakeups
+    if (rc->flow_cap > 0 && rc->sched_policy == POLICY_RACE) rc->sched_policy = POLICY_RR;
+    if (rc->sched_policy != POLICY_RACE) rc->wakeup_mode = WAKE_TARGETED;
+    else if (rc->wakeup_mode == WAKE_TARGETED) rc->sched_policy = POLICY_RR;
+
+    if (gen->limit == 0 && gen->duration == 0) gen->limit = 100;
+}
+
+// Long name of the option whose getopt value is val.
+const char *option_name(const struct option *opts, int val) {
+    while (opts->name != NULL && opts->val != val) opts++;
+    return opts->name;
+}
+
+// Parameter sweeps ----------------------------------------------------------------
+// --sweep=NAME=V1:V2:... (repeatable) simulates every combination of the
+// listed values of run options on the event engine, e.g.
+//   --sweep rate=0.05:0.1:0.2 --sweep sched=rr:lqf --sweep stop=1:2
+// is 12 runs; options not swept keep their command-line values. Each run has
+// its own config (cfg points at it while it runs), cars and simulation, so
+// runs share nothing but the work queue: one word per worker holding the
+// range of run indices it still owns. A worker takes from the front of its
+// range and, once that is empty, steals the back half of another's with a
+// single CAS. Indices are never handed out twice, so a stale CAS can only
+// fail. One table of results comes out at the end, in run order (the last
+// axis varies fastest).
+
+#define SWEEP_MAX_AXES 16
+
+typedef struct {
+    const char *name;        // run option
+    char **values;
+    int nvalues;
+} sweep_axis_t;
+
+typedef struct {
+    long cars;               // cars that completed their route
+    double makespan;         // time of the last event (seconds)
+    double mean_wait;        // wait beyond the stop per intersection passed
+    double p99_wait;
+} sweep_result_t;
+
+typedef struct sweep_queue {
+    _Alignas(64) _Atomic uint64_t range;   // first << 32 | end, runs not started
+    struct sweep *sw;
+} sweep_queue_t;
+
+typedef struct sweep {
+    sweep_axis_t axes[SWEEP_MAX_AXES];
+    int naxes;
+    long nruns;
+
+    // the command line's run options, the starting point of every run
+    run_config_t base;
+    gen_source_t gen;
+    uint64_t seed;
+    int generate;
+
+    sweep_result_t *results;
+    sweep_queue_t *queues;
+    int nworkers;
+} sweep_t;
+
+// Parse one --sweep argument, checking every value.
+int sweep_axis(sweep_t *sw, const char *arg) {
+    const char *eq = strchr(arg, '=');
+    if (eq == NULL || eq[1] == '\0' || sw->naxes == SWEEP_MAX_AXES) return -1;
+    sweep_axis_t *a = &sw->axes[sw->naxes];
+    a->name = strndup(arg, eq - arg);
+    a->values = NULL;
+    a->nvalues = 0;
+
+    char *list = strdup(eq + 1), *save = NULL;
+    assert(a->name != NULL && list != NULL);
+    for (char *v = strtok_r(list, ":", &save); v != NULL; v = strtok_r(NULL, ":", &save)) {
+        run_config_t rc = config;
+        gen_source_t g = {.headway = 1.0};
+        uint64_t seed;
+        int ok = config_option(&rc, &g, &seed, a->name, v);
+        if (ok != 1) {
+            fprintf(stderr, ok < 0 ? "--sweep: %s is not a run option\n"
+                                   : "--sweep: bad value for %s: '%s'\n", a->name, v);
+            return -1;
+        }
+        a->values = realloc(a->values, (a->nvalues + 1) * sizeof(char *));
+        assert(a->values != NULL);
+        a->values[a->nvalues++] = v;
+    }
+    if (a->nvalues == 0) return -1;
+    sw->naxes++;
+    return 0;
+}
+
+// Value index of axis k in run i.
+int sweep_choice(const sweep_t *sw, long i, int k) {
+    for (int j = sw->naxes - 1; j > k; j--) i /= sw->axes[j].nvalues;
+    return (int)(i % sw->axes[k].nvalues);
+}
+
+// Options of run i.
+void sweep_point(const sweep_t *sw, long i, run_config_t *rc, gen_source_t *gen,
+                 uint64_t *seed) {
+    *rc = sw->base;
+    *gen = sw->gen;
+    *seed = sw->seed;
+    for (int k = 0; k < sw->naxes; k++) {
+        const sweep_axis_t *a = &sw->axes[k];
+        config_option(rc, gen, seed, a->name, a->values[sweep_choice(sw, i, k)]);
+    }
+    config_finish(rc, gen);
+}
+
+void sweep_one(sweep_t *sw, long i) {
+    run_config_t rc;
+    gen_source_t gen;
+    uint64_t seed;
+    sweep_point(sw, i, &rc, &gen, &seed);
+    cfg = &rc;
+
+    array_source_t builtin;
+    car_source_t *src = &builtin.base;
+    if (sw->generate) {
+        gen_source_init(&gen, seed);
+        src = &gen.base;
+    } else {
+        array_source_init(&builtin, cars, NUM_CARS);
+    }
+
+    sim_summary_t sum;
+    sim_summarize(src, &sum);
+    sweep_result_t *r = &sw->results[i];
+    r->cars = sum.cars;
+    r->makespan = sum.makespan;
+    r->mean_wait = HistMean(&sum.wait) / 1e6;
+    r->p99_wait = HistQuantile(&sum.wait, 0.99) / 1e6;
+    cfg = &config;
+}
+
+#define RANGE(first, end) ((uint64_t)(first) << 32 | (uint32_t)(end))
+
+// Take the next run of our own range, or -1 if it is empty.
+long sweep_take(sweep_queue_t *q) {
+    uint64_t r = atomic_load(&q->range);
+    for (;;) {
+        uint32_t first = r >> 32, end = (uint32_t)r;
+        if (first >= end) return -1;
+        if (atomic_compare_exchange_weak(&q->range, &r, RANGE(first + 1, end))) return first;
+    }
+}
+
+// Move the back half of someone's range into our (empty) one; 0 if there
+// was nothing left anywhere.
+int sweep_steal(sweep_queue_t *me) {
+    sweep_t *sw = me->sw;
+    int id = (int)(me - sw->queues);
+    for (int k = 1; k < sw->nworkers; k++) {
+        sweep_queue_t *victim = &sw->queues[(id + k) % sw->nworkers];
+        uint64_t r = atomic_load(&victim->range);
+        for (;;) {
+            uint32_t first = r >> 32, end = (uint32_t)r;
+            if (first >= end) break;
+            uint32_t mid = first + (end - first) / 2;
+            if (atomic_compare_exchange_weak(&victim->range, &r, RANGE(first, mid))) {
+                atomic_store(&me->range, RANGE(mid, end));
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+void *SweepWorker(void *arg) {
+    sweep_queue_t *q = (sweep_queue_t *)arg;
+    for (;;) {
+        long i = sweep_take(q);
+        if (i >= 0) sweep_one(q->sw, i);
+        else if (!sweep_steal(q)) break;
+    }
+    return NULL;
+}
+
+void sweep_print(const sweep_t *sw) {
+    int w[SWEEP_MAX_AXES];
+    for (int k = 0; k < sw->naxes; k++) {
+        w[k] = (int)strlen(sw->axes[k].name);
+        for (int v = 0; v < sw->axes[k].nvalues; v++) {
+            int len = (int)strlen(sw->axes[k].values[v]);
+            if (len > w[k]) w[k] = len;
+        }
+    }
+
+    for (int k = 0; k < sw->naxes; k++) printf("%-*s  ", w[k], sw->axes[k].name);
+    printf("%8s %10s %9s %9s %9s\n", "cars", "makespan", "cars/h", "mean wait", "p99 wait");
+    for (long i = 0; i < sw->nruns; i++) {
+        const sweep_result_t *r = &sw->results[i];
+        for (int k = 0; k < sw->naxes; k++) {
+            printf("%-*s  ", w[k], sw->axes[k].values[sweep_choice(sw, i, k)]);
+        }
+        printf("%8ld %10.1f %9.1f %9.3f %9.3f\n", r->cars, r->makespan,
+               r->makespan > 0 ? r->cars * 3600.0 / r->makespan : 0.0,
+               r->mean_wait, r->p99_wait);
+    }
+}
+
+// Run every point of the sweep on up to nworkers threads and print the table.
+void sweep_run(sweep_t *sw, int nworkers) {
+    sw->nruns = 1;
+    for (int k = 0; k < sw->naxes; k++) {
+        sw->nruns *= sw->axes[k].nvalues;
+        if (sw->nruns > UINT32_MAX) {
+            fprintf(stderr, "--sweep: too many runs\n");
+            exit(1);
+        }
+    }
+    sw->nworkers = nworkers < sw->nruns ? nworkers : (int)sw->nruns;
+    sw->results = calloc(sw->nruns, sizeof(sweep_result_t));
+    sw->queues = aligned_alloc(64, sw->nworkers * sizeof(sweep_queue_t));
+    assert(sw->results != NULL && sw->queues != NULL);
+
+    // contiguous blocks to start with; stealing evens out uneven runs
+    for (int i = 0; i < sw->nworkers; i++) {
+        long first = sw->nruns * i / sw->nworkers;
+        long end = sw->nruns * (i + 1) / sw->nworkers;
+        atomic_init(&sw->queues[i].range, RANGE(first, end));
+        sw->queues[i].sw = sw;
+    }
+
+    double begin = GetMonoTime();
+    pthread_t *workers = malloc(sw->nworkers * sizeof(pthread_t));
+    assert(workers != NULL);
+    for (int i = 0; i < sw->nworkers; i++) {
+        pin_create(&workers[i], i, SweepWorker, &sw->queues[i]);
+    }
+    for (int i = 0; i < sw->nworkers; i++) {
+        Pthread_join(workers[i], NULL);
+    }
+    fprintf(stderr, "sweep: %ld runs on %d workers in %.3f s\n",
+            sw->nruns, sw->nworkers, GetMonoTime() - begin);
+
+    sweep_print(sw);
+    free(workers);
+    free(sw->queues);
+    free(sw->results);
+}
+
+// main -------------------------------------------------------------------
+
+// Execution engines
+typedef enum {ENGINE_THREAD, ENGINE_DES, ENGINE_POOL, ENGINE_PART, ENGINE_PDES} engine_t;
+
+void usage(const char *prog) {
+    fprintf(stderr,
+            "usage: %s [options]\n"
+            "  -e, --engine=thread|des|pool|part|pdes\n"
+            "                            one pthread per car in real time (default),\n"
+            "                            discrete-event simulation on a virtual clock,\n"
+            "                            cars as state machines on a worker pool,\n"
+            "                            the grid split into bands of intersections,\n"
+            "                            one worker each, in real time, or the same\n"
+            "                            bands simulated in parallel on the virtual\n"
+            "                            clock (same output as des)\n"
+            "      --grid=RxC            R rows by C columns of intersections; cars\n"
+            "                            are generated at the edges and routed to a\n"
+            "                            random intersection (needs --generate)\n"
+            "      --link=T              travel time between neighbouring\n"
+            "                            intersections (default 10 seconds)\n"
+            "      --stop=T              mandatory stop at the sign (default 2 seconds)\n"
+            "      --cross-time=L,S,R    seconds to cross turning left, going straight\n"
+            "                            and turning right (default 5,4,3)\n"
+            "  -f, --flow=serial|pipelined\n"
+            "                            release a direction's head-of-line token at\n"
+            "                            exit (default), or once quadrants are held\n"
+            "  -a, --admission=direction|conflict\n"
+            "                            one direction owns the intersection at a time\n"
+            "                            (default), or admit any set of movements that\n"
+            "                            share no quadrant\n"
+            "      --starve-limit=K      times a car may be overtaken under conflict\n"
+            "                            admission before it blocks conflicting cars\n"
+            "                            (default 4)\n"
+            "      --wakeup=broadcast|targeted\n"
+            "                            when a flow ends, wake every waiting car\n"
+            "                            (default), or hand the intersection to the\n"
+            "                            next waiting direction round-robin and wake\n"
+            "                            only that direction\n"
+            "      --sched=race|rr|lqf|oldest|maxweight\n"
+            "                            who gets the intersection next: whoever wins\n"
+            "                            the wakeup race (default), round-robin,\n"
+            "                            longest queue, oldest waiting car, or the\n"
+            "                            heaviest set of compatible movements; any\n"
+            "                            policy but race implies --wakeup=targeted\n"
+            "      --flow-cap=K          under direction admission, yield after K cars\n"
+            "                            from one direction if another is waiting\n"
+            "                            (default 0 = no cap; implies --sched=rr if\n"
+            "                            no policy is given)\n"
+            "  -q, --quads=mutex|mask    lock quadrants one mutex at a time in sorted\n"
+            "                            order (default), or claim them all at once\n"
+            "                            with a CAS on an occupancy bitmask\n"
+            "      --signal=off|fixed|actuated|pressure\n"
+            "                            traffic lights instead of stop signs: cars\n"
+            "                            don't stop and go on green (replaces the\n"
+            "                            admission, wakeup and sched options); phases\n"
+            "                            run for their planned time, or actuated: for\n"
+            "                            5 s plus 2 s per queued car up to that time,\n"
+            "                            skipping phases nobody waits for, or by max\n"
+            "                            pressure: every 5 s the phase with the most\n"
+            "                            queued cars and head-of-line wait goes, for\n"
+            "                            at most its planned time while others wait\n"
+            "      --phases=A/T=S,...    signal plan: approaches A (of NESW) get green\n"
+            "                            for turns T (of LSR) for S seconds (default\n"
+            "                            NS/SR=30,NS/L=10,EW/SR=30,EW/L=10)\n"
+            "  -i, --input=FILE          read cars from a CSV or binary workload file\n"
+            "                            ('-' for stdin) instead of the built-in cars\n"
+            "      --write-workload=FILE convert the input cars to a binary workload\n"
+            "                            file and exit\n"
+            "  -g, --generate            synthesize cars instead of using cars[]:\n"
+            "      --rate=R[,R,R,R]      cars/second on every approach, or on N,E,S,W\n"
+            "                            (default 0.05)\n"
+            "      --mix=L,S,R           left/straight/right weights (default 1,1,1)\n"
+            "      --platoon=K[,H]       arrive in bursts of K cars H seconds apart\n"
+            "                            (default 1, i.e. plain Poisson; H = 1.0)\n"
+            "      --cars=N              generate N cars (default 100 unless\n"
+            "                            --duration is given)\n"
+            "      --duration=T          generate arrivals up to time T seconds\n"
+            "      --seed=S              random seed (default 1)\n"
+            "  -l, --log=sync|async      print each event under print_lock (default),\n"
+            "                            or queue to a background writer that merges\n"
+            "                            per-thread buffers by timestamp\n"
+            "  -T, --trace=FILE          also write events to a binary trace file\n"
+            "      --trace-compress      delta/varint-compress the trace in blocks\n"
+            "      --decode-trace=FILE   print a binary trace as the text log and exit\n"
+            "  -Q, --quiet               don't print the text log\n"
+            "  -L, --latency             report per-car wait percentiles at exit\n"
+            "      --checkpoint=FILE@T[,P]\n"
+            "                            with -e des, write the simulation state to\n"
+            "                            FILE once the clock reaches T seconds, and\n"
+            "                            again every P seconds after that\n"
+            "      --restore=FILE        start the -e des run, or every --sweep point,\n"
+            "                            from a snapshot instead of from t = 0 (give\n"
+            "                            the options it was taken with; change any\n"
+            "                            that don't shape the state for a what-if)\n"
+            "      --metrics=FILE[,S]    publish throughput, queue depths, quadrant\n"
+            "                            occupancy and recent p99 wait to the shared\n"
+            "                            memory page FILE every S seconds (default 1)\n"
+            "      --watch=FILE          print what a run publishes to FILE, and exit\n"
+            "                            when it ends (status 1 if it stops publishing\n"
+            "                            for 5 intervals)\n"
+            "      --bench=sim|cpu       run the canned workloads and print JSON:\n"
+            "                            simulated throughput and waits on the event\n"
+            "                            engine, or CPU cost and context switches per\n"
+            "                            car of the real car actions with zero delays\n"
+            "                            on -w threads\n"
+            "      --sweep=OPT=V1:V2:... simulate every combination of the listed\n"
+            "                            values of run options (repeatable; any of\n"
+            "                            flow, admission, quads, starve-limit, wakeup,\n"
+            "                            sched, flow-cap, grid, link, stop, cross-time,\n"
+            "                            signal, phases, rate, mix, platoon, cars,\n"
+            "                            duration, seed) on the event engine and\n"
+            "                            print one table\n"
+            "  -w, --workers=N           pool size, number of grid bands or sweep\n"
+            "                            threads (default: number of online CPUs)\n"
+            "      --pin=auto|CPUS       run worker i of the pool, a grid or a sweep\n"
+            "                            on the i-th CPU of the list (e.g. 0-7,16-23),\n"
+            "                            or of every CPU one NUMA node after another;\n"
+            "                            a grid band's intersections go in its node's\n"
+            "                            memory (not with -e thread)\n"
+            "  -c, --cross=spin|sleep    busy-wait while crossing (default), or sleep\n"
+            "                            to an absolute CLOCK_MONOTONIC deadline\n"
+            "      --speed=N             run the real-time engines N times faster\n"
+            "                            than simulated time; logs and latencies\n"
+            "                            stay in simulated seconds (default 1)\n"
+            "  -h, --help                show this message\n",
+            prog);
+}
+
+int main(int argc, char *argv[]) {
+    engine_t engine = ENGINE_THREAD;
+    int workers = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    const char *input = NULL;     // workload file, NULL for cars[]
+    const char *dump_path = NULL; // --write-workload target
+
+    const char *trace_path = NULL; // --trace target
+    int trace_compress = 0;
+
+    int generate = 0;
+    uint64_t seed = 1;
+    static sweep_t sweep;         // --sweep axes, none for a single run
+    int bench = 0;                // --bench: 1 = sim, 2 = cpu
+    const char *restore_path = NULL; // --restore snapshot
+    const char *metrics_path = NULL; // --metrics page
+    double metrics_interval = 1.0;
+    snapshot_t *snap = NULL;
+    gen_source_t gen = {
+        .rate = {0.05, 0.05, 0.05, 0.05},
+        .mix = {1, 1, 1},
+        .platoon = 1,
+        .headway = 1.0,
+    };
+
+    static struct option long_opts[] = {
+        {"engine", required_argument, NULL, 'e'},
+        {"cross",  required_argument, NULL, 'c'},
+        {"flow",   required_argument, NULL, 'f'},
+        {"workers", required_argument, NULL, 'w'},
+        {"admission", required_argument, NULL, 'a'},
+        {"quads",  required_argument, NULL, 'q'},
+        {"starve-limit", required_argument, NULL, 'S'},
+        {"input",  required_argument, NULL, 'i'},
+        {"write-workload", required_argument, NULL, 'W'},
+        {"generate", no_argument,     NULL, 'g'},
+        {"log",    required_argument, NULL, 'l'},
+        {"trace",  required_argument, NULL, 'T'},
+        {"trace-compress", no_argument, NULL, 'Z'},
+        {"decode-trace", required_argument, NULL, 'X'},
+        {"quiet",  no_argument,       NULL, 'Q'},
+        {"latency", no_argument,      NULL, 'L'},
+        {"rate",   required_argument, NULL, 'R'},
+        {"mix",    required_argument, NULL, 'M'},
+        {"platoon", required_argument, NULL, 'P'},
+        {"cars",   required_argument, NULL, 'N'},
+        {"duration", required_argument, NULL, 'D'},
+        {"seed",   required_argument, NULL, 's'},
+        {"wakeup", required_argument, NULL, 'U'},
+        {"sched",  required_argument, NULL, 'Y'},
+        {"flow-cap", required_argument, NULL, 'K'},
+        {"grid",   required_argument, NULL, 'G'},
+        {"link",   required_argument, NULL, 'k'},
+        {"stop",   required_argument, NULL, 'O'},
+        {"cross-time", required_argument, NULL, 'x'},
+        {"sweep",  required_argument, NULL, 'V'},
+        {"bench",  required_argument, NULL, 'B'},
+        {"speed",  required_argument, NULL, 'I'},
+        {"signal", required_argument, NULL, 'A'},
+        {"phases", required_argument, NULL, 'H'},
+        {"checkpoint", required_argument, NULL, 'C'},
+        {"restore", required_argument, NULL, 'r'},
+        {"metrics", required_argument, NULL, 'm'},
+        {"watch",  required_argument, NULL, 'J'},
+        {"pin",    required_argument, NULL, 'p'},
+        {"help",   no_argument,       NULL, 'h'},
+        {NULL, 0, NULL, 0}
+    };
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "e:c:f:w:a:q:i:gl:T:QLh", long_opts, NULL)) != -1) {
+        switch (opt) {
+        case 'e':
+            if (strcmp(optarg, "thread") == 0)   engine = ENGINE_THREAD;
+            else if (strcmp(optarg, "des") == 0) engine = ENGINE_DES;
+            else if (strcmp(optarg, "pool") == 0) engine = ENGINE_POOL;
+            else if (strcmp(optarg, "part") == 0) engine = ENGINE_PART;
+            else if (strcmp(optarg, "pdes") == 0) engine = ENGINE_PDES;
+            else { usage(argv[0]); return 1; }
+            break;
+        case 'c':
+            if (strcmp(optarg, "spin") == 0)       cross_mode = CROSS_SPIN;
+            else if (strcmp(optarg, "sleep") == 0) cross_mode = CROSS_SLEEP;
+            else { usage(argv[0]); return 1; }
+            break;
+        case 'I':
+            if (parse_doubles(optarg, &time_scale, 1) != 1 || time_scale <= 0) {
+                usage(argv[0]);
+                return 1;
+            }
+            break;
+        case 'i':
+            input = optarg;
+            break;
+        case 'W':
+            dump_path = optarg;
+            break;
+        case 'l':
+            if (strcmp(optarg, "sync") == 0)       log_mode = LOG_SYNC;
+            else if (strcmp(optarg, "async") == 0) log_mode = LOG_ASYNC;
+            else { usage(argv[0]); return 1; }
+            break;
+        case 'T':
+            trace_path = optarg;
+            break;
+        case 'Z':
+            trace_compress = 1;
+            break;
+        case 'X':
+            return decode_trace(optarg);
+        case 'Q':
+            log_quiet = 1;
+            break;
+        case 'L':
+            latency_on = 1;
+            break;
+        case 'g':
+            generate = 1;
+            break;
+        case 'f': case 'a': case 'q': case 'S': case 'U': case 'Y': case 'K':
+        case 'G': case 'k': case 'O': case 'x': case 'A': case 'H':
+        case 'R': case 'M': case 'P': case 'N': case 'D': case 's':
+            if (config_option(&config, &gen, &seed, option_name(long_opts, opt), optarg) != 1) {
+                usage(argv[0]);
+                return 1;
+            }
+            break;
+        case 'B':
+            if (strcmp(optarg, "sim") == 0)      bench = 1;
+            else if (strcmp(optarg, "cpu") == 0) bench = 2;
+            else { usage(argv[0]); return 1; }
+            break;
+        case 'V':
+            if (sweep_axis(&sweep, optarg) != 0) { usage(argv[0]); return 1; }
+            break;
+        case 'C': {
+            const char *at = strrchr(optarg, '@');
+            double t[2] = {0, 0};
+            if (at == NULL || at == optarg || parse_doubles(at + 1, t, 2) < 1) {
+                usage(argv[0]);
+                return 1;
+            }
+            checkpoint_path = strndup(optarg, at - optarg);
+            checkpoint_at = t[0];
+            checkpoint_every = t[1];
+            break;
+        }
+        case 'r':
+            restore_path = optarg;
+            break;
+        case 'm': {
+            const char *comma = strrchr(optarg, ',');
+            if (comma != NULL) {
+                if (parse_doubles(comma + 1, &metrics_interval, 1) != 1 ||
+                    metrics_interval <= 0 || comma == optarg) { usage(argv[0]); return 1; }
+                metrics_path = strndup(optarg, comma - optarg);
+            } else {
+                metrics_path = optarg;
+            }
+            break;
+        }
+        case 'J':
+            return watch_metrics(optarg);
+        case 'p':
+            if (pin_setup(optarg) != 0) return 1;
+            break;
+        case 'w': {
+            char *end;
+            long v = strtol(optarg, &end, 10);
+            if (end == optarg || *end != '\0' || v < 1 || v > INT_MAX) {
+                usage(argv[0]);
+                return 1;
+            }
+            workers = (int)v;
+            break;
+        }
+        case 'h':
+            usage(argv[0]);
+            return 0;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (metrics_path != NULL && (sweep.naxes > 0 || bench || dump_path != NULL)) {
+        fprintf(stderr, "--metrics watches a single run\n");
+        return 1;
+    }
+
+    // the thread engine has no workers, and des and bench run on one thread
+    if (pin_cpus != NULL && sweep.naxes == 0 &&
+        (bench || (engine != ENGINE_POOL && engine != ENGINE_PART && engine != ENGINE_PDES))) {
+        fprintf(stderr, "--pin needs -e pool, part or pdes, or --sweep\n");
+        return 1;
+    }
+
+    // snapshots hold event-engine state
+    if (checkpoint_path != NULL && (engine != ENGINE_DES || sweep.naxes > 0 || bench)) {
+        fprintf(stderr, "--checkpoint needs -e des\n");
+        return 1;
+    }
+    if (restore_path != NULL) {
+        if ((engine != ENGINE_DES && sweep.naxes == 0) || bench || dump_path != NULL) {
+            fprintf(stderr, "--restore needs -e des or --sweep\n");
+            return 1;
+        }
+        // the generator's random state comes from the snapshot
+        for (int k = 0; k < sweep.naxes; k++) {
+            if (strcmp(sweep.axes[k].name, "seed") == 0) {
+                fprintf(stderr, "--restore continues the snapshot's random stream, "
+                        "so a seed sweep would repeat one run\n");
+                return 1;
+            }
+            // every point must restore the same kind of intersection; check
+            // here rather than fail in a worker halfway through the sweep
+            const sweep_axis_t *ax = &sweep.axes[k];
+            int fixed = strcmp(ax->name, "grid") == 0 || strcmp(ax->name, "flow") == 0 ||
+                        strcmp(ax->name, "admission") == 0 ||
+                        strcmp(ax->name, "quads") == 0 || strcmp(ax->name, "phases") == 0;
+            for (int v = 0; !fixed && v < ax->nvalues; v++) {
+                fixed = strcmp(ax->name, "signal") == 0 &&
+                        (strcmp(ax->values[v], "off") == 0) != (config.signal == SIGNAL_OFF);
+            }
+            if (fixed) {
+                fprintf(stderr, "--restore needs the options the snapshot was taken "
+                        "with, so --sweep cannot vary %s\n",
+                        strcmp(ax->name, "signal") == 0 ? "signals on and off" : ax->name);
+                return 1;
+            }
+        }
+        snap = snap_open(restore_path);
+        restore_from = snap;
+        fprintf(stderr, "restore: %s, taken at t=%.3f: %lld cars in flight, "
+                "%lld events pending\n", restore_path, snap->h->at,
+                (long long)snap->h->ncars, (long long)snap->h->nevents);
+    }
+
+    if (sweep.naxes > 0) {
+        int routed = config.grid_on;
+        for (int k = 0; k < sweep.naxes; k++) {
+            if (strcmp(sweep.axes[k].name, "grid") == 0) routed = 1;
+        }
+        if (input != NULL || dump_path != NULL || trace_path != NULL ||
+            (routed && !generate)) {
+            fprintf(stderr, "--sweep runs cars[] or --generate, without --input, "
+                    "--write-workload or --trace (and --grid needs --generate)\n");
+            return 1;
+        }
+        sweep.base = config;
+        sweep.gen = gen;
+        sweep.seed = seed;
+        sweep.generate = generate;
+        log_quiet = 1;
+        sweep_run(&sweep, workers);
+        if (snap != NULL) snap_close(snap);
+        return 0;
+    }
+    config_finish(&config, &gen);
+
+    if (bench) {
+        if (config.grid_on) {
+            fprintf(stderr, "--bench runs a single intersection\n");
+            return 1;
+        }
+        // the phases run on the real clock, so zero-delay cars would sit
+        // through every red
+        if (bench == 2 && config.signal != SIGNAL_OFF) {
+            fprintf(stderr, "--bench=cpu runs stop signs (no --signal)\n");
+            return 1;
+        }
+        log_quiet = 1;
+        Pthread_mutex_init(&print_lock, NULL);
+        if (bench == 1) bench_sim();
+        else            bench_cpu(workers);
+        LOCK_STATS_REPORT(stderr);   // stdout holds the JSON
+        return 0;
+    }
+
+    // Only generated cars have routes, and workload files and traces have
+    // no field for the intersection
+    if (config.grid_on && (!generate || input != NULL || dump_path != NULL || trace_path != NULL)) {
+        fprintf(stderr, "--grid needs --generate and does not support --input, "
+                "--write-workload or --trace\n");
+        return 1;
+    }
+    if (engine == ENGINE_PDES && !config.grid_on) {
+        fprintf(stderr, "-e pdes simulates a --grid\n");
+        return 1;
+    }
+
+    // Initialize print mutex
+    Pthread_mutex_init(&print_lock, NULL);
+
+    array_source_t builtin;
+    file_source_t file;
+    car_source_t *src = &builtin.base;
+    if (input != NULL) {
+        file_source_open(&file, input);
+        src = &file.base;
+    } else if (generate) {
+        gen_source_init(&gen, seed);
+        src = &gen.base;
+    } else {
+        array_source_init(&builtin, cars, NUM_CARS);
+    }
+
+    if (trace_path != NULL && dump_path == NULL) {
+        trace_open(trace_path, trace_compress);
+    }
+
+    if (metrics_path != NULL) {
+        metrics_start(metrics_path, metrics_interval,
+                      engine == ENGINE_DES || engine == ENGINE_PDES);
+    }
+
+    if (dump_path != NULL) {
+        long n = write_workload(src, dump_path);
+        fprintf(stderr, "wrote %ld cars to %s\n", n, dump_path);
+    } else if (engine == ENGINE_DES) {
+        sim_run(src);
+    } else if (engine == ENGINE_POOL) {
+        pool_run(src, workers > 0 ? workers : 1);
+    } else if (engine == ENGINE_PART) {
+        part_run(src, workers > 0 ? workers : 1);
+    } else if (engine == ENGINE_PDES) {
+        pdes_run(src, workers > 0 ? workers : 1);
+    } else {
+        thread_run(src);
+    }
+
+    metrics_stop();
+    trace_close();
+    if (input != NULL) file_source_close(&file);
+    if (snap != NULL) snap_close(snap);
+    LOCK_STATS_REPORT(stdout);
 
     return 0;
 }